@@ -3,6 +3,7 @@
 
 
 #include <ostream>
+#include <random>
 
 using namespace std;
 class ComparisonException : public std::exception {
@@ -12,7 +13,13 @@ class ComparisonException : public std::exception {
 class PublicationId {
 
     int id;
-    static int exception_prob;
+    // Per thread, so that parallel tests can inject failures independently
+    static thread_local int exception_prob;
+
+    static std::minstd_rand &exception_engine() {
+        static thread_local std::minstd_rand engine;
+        return engine;
+    }
 
 public:
 
@@ -23,7 +30,7 @@ public:
     PublicationId(PublicationId &&p) : id(p.id) {};
 
     bool operator<(const PublicationId &rhs) const {
-        if (rand() % 100 < exception_prob) {
+        if (exception_prob > 0 && static_cast<int>(exception_engine()() % 100) < exception_prob) {
             throw ComparisonException();
         }
         return id < rhs.id;
@@ -37,6 +44,10 @@ public:
         PublicationId::exception_prob = p;
     }
 
+    static void seed_exceptions(unsigned seed){
+        exception_engine().seed(seed);
+    }
+
 
     friend std::ostream &operator<<(ostream &os, const PublicationId &id) {
         os << id.id;
@@ -46,7 +57,7 @@ public:
 
 };
 
-int PublicationId::exception_prob = 0;
+thread_local int PublicationId::exception_prob = 0;
 
 
 template<typename T>
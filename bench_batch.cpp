@@ -0,0 +1,81 @@
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <algorithm>
+#include "citation_graph.h"
+#include "citation_wal.h"
+#include "Publication.h"
+
+using namespace std;
+
+/**
+ * Cost of batches against individual mutations: the same creates, each publication citing
+ * the source and its predecessor, run one by one and grouped by begin_batch(). In memory the
+ * batch only adds its undo log; with a write-ahead log that writes, and with sync fsyncs,
+ * every record it is given, a batch is written and synced once.
+ *
+ * Usage: bench_batch [batches] [creates per batch] [log path], meant for a Release build
+ */
+
+using Graph = CitationGraph<Publication<int>>;
+
+enum Log {
+    NONE, WRITTEN, SYNCED
+};
+
+double seconds(Log mode, bool batched, int batches, int size, string const &path) {
+    remove(path.c_str());
+    unique_ptr<WriteAheadLog<int>> wal;
+    if (mode != NONE) {
+        wal = make_unique<WriteAheadLog<int>>(path, 1, mode == SYNCED);
+    }
+    Graph graph(0);
+    graph.set_log(wal.get());
+    auto start = chrono::steady_clock::now();
+    int id = 1;
+    for (int b = 0; b < batches; ++b) {
+        if (batched) {
+            auto batch = graph.begin_batch();
+            for (int i = 0; i < size; ++i, ++id) {
+                graph.create(id, {0, id - 1});
+            }
+            batch.commit();
+        } else {
+            for (int i = 0; i < size; ++i, ++id) {
+                graph.create(id, {0, id - 1});
+            }
+        }
+    }
+    double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    graph.set_log(nullptr);
+    wal.reset();
+    remove(path.c_str());
+    return elapsed;
+}
+
+int main(int argc, char **argv) {
+    int batches = argc > 1 ? atoi(argv[1]) : 2000;
+    int size = argc > 2 ? atoi(argv[2]) : 50;
+    string path = argc > 3 ? argv[3] : "bench_batch.log";
+
+    cout << batches << " batches of " << size << " creates, seconds" << endl;
+    cout << setw(10) << "log" << setw(14) << "individually" << setw(10) << "batched" << setw(10) << "speedup"
+         << endl;
+    char const *names[] = {"none", "written", "synced"};
+    for (Log mode : {NONE, WRITTEN, SYNCED}) {
+        // Best of three, but for the slow synced runs
+        double individually = 1e300;
+        double batched = 1e300;
+        for (int repeat = mode == SYNCED ? 1 : 3; repeat > 0; --repeat) {
+            individually = min(individually, seconds(mode, false, batches, size, path));
+            batched = min(batched, seconds(mode, true, batches, size, path));
+        }
+        cout << setw(10) << names[mode] << fixed << setprecision(3) << setw(14) << individually << setw(10)
+             << batched << setprecision(1) << setw(9) << individually / batched << "x" << endl;
+    }
+    return 0;
+}
@@ -0,0 +1,264 @@
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <boost/multiprecision/cpp_int.hpp>
+#include "citation_graph.h"
+#include "Publication.h"
+
+using namespace std;
+
+/**
+ * Cost of every CitationGraph operation for each id type in use: plain ints, DOI strings,
+ * PublicationId and arbitrary precision integers. Every type runs the same random graph,
+ * results are nanoseconds per operation. A last run with CountedId adds the id copies and
+ * comparisons per operation, which is what an expensive id pays for.
+ *
+ * Usage: bench_ids [publications] [seed], meant for a Release build
+ */
+
+using BigId = boost::multiprecision::cpp_int;
+
+// An int id that counts its copies and comparisons, moves are free
+struct CountedId {
+    static size_t copies;
+    static size_t comparisons;
+
+    int value;
+
+    CountedId(int value) : value(value) {}
+
+    CountedId(CountedId const &other) : value(other.value) { ++copies; }
+
+    CountedId(CountedId &&other) noexcept = default;
+
+    CountedId &operator=(CountedId const &other) {
+        value = other.value;
+        ++copies;
+        return *this;
+    }
+
+    CountedId &operator=(CountedId &&other) noexcept = default;
+
+    bool operator<(CountedId const &other) const {
+        ++comparisons;
+        return value < other.value;
+    }
+
+    bool operator==(CountedId const &other) const {
+        ++comparisons;
+        return value == other.value;
+    }
+
+    friend ostream &operator<<(ostream &os, CountedId const &id) {
+        return os << id.value;
+    }
+};
+
+size_t CountedId::copies = 0;
+size_t CountedId::comparisons = 0;
+
+template<typename Id>
+struct IdTraits;
+
+template<>
+struct IdTraits<int> {
+    static constexpr const char *name = "int";
+
+    static int make(int i) { return i; }
+};
+
+template<>
+struct IdTraits<string> {
+    static constexpr const char *name = "string";
+
+    // Long enough to live on the heap, sharing a prefix like real DOIs do
+    static string make(int i) {
+        string digits = to_string(i);
+        return "10.1000/citation.graph." + string(10 - digits.size(), '0') + digits;
+    }
+};
+
+template<>
+struct IdTraits<PublicationId> {
+    static constexpr const char *name = "PublicationId";
+
+    static PublicationId make(int i) { return PublicationId(i); }
+};
+
+template<>
+struct IdTraits<BigId> {
+    static constexpr const char *name = "cpp_int";
+
+    static BigId make(int i) { return (BigId(1) << 256) + i; }
+};
+
+template<>
+struct IdTraits<CountedId> {
+    static constexpr const char *name = "CountedId";
+
+    static CountedId make(int i) { return CountedId(i); }
+};
+
+const char *const OPERATIONS[] = {"create", "add_citation", "exists", "operator[]", "get_children",
+                                  "get_parents", "has_citation", "depth", "remove"};
+const size_t OPERATION_COUNT = sizeof(OPERATIONS) / sizeof(OPERATIONS[0]);
+
+struct Cost {
+    double ns;
+    double copies;
+    double comparisons;
+};
+
+struct Timer {
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    size_t copies = CountedId::copies;
+    size_t comparisons = CountedId::comparisons;
+
+    Cost per_op(size_t ops) const {
+        return {chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / ops,
+                static_cast<double>(CountedId::copies - copies) / ops,
+                static_cast<double>(CountedId::comparisons - comparisons) / ops};
+    }
+};
+
+// Keeps the optimizer from dropping query results
+volatile size_t sink = 0;
+
+template<typename Id>
+vector<Cost> run(int n, unsigned seed) {
+    using Graph = CitationGraph<Publication<Id>>;
+    mt19937 rng(seed);
+    vector<Id> ids;
+    ids.reserve(n);
+    for (int i = 0; i < n; ++i) {
+        ids.push_back(IdTraits<Id>::make(i));
+    }
+    // Up to three parents among the earlier publications, node 0 is the source
+    vector<vector<Id>> parents(n);
+    for (int i = 1; i < n; ++i) {
+        for (int k = 1 + rng() % 3; k > 0; --k) {
+            parents[i].push_back(ids[rng() % i]);
+        }
+    }
+    vector<pair<int, int>> citations;
+    for (int i = 2; i < n; ++i) {
+        citations.emplace_back(i, rng() % i);
+    }
+    vector<int> probes(n);
+    for (int &p : probes) {
+        p = rng() % n;
+    }
+
+    vector<Cost> result;
+    Graph graph(ids[0]);
+    Timer timer;
+    for (int i = 1; i < n; ++i) {
+        if (parents[i].size() == 1) {
+            graph.create(ids[i], parents[i][0]);
+        } else {
+            graph.create(ids[i], parents[i]);
+        }
+    }
+    result.push_back(timer.per_op(n - 1));
+
+    timer = Timer();
+    for (auto const &c : citations) {
+        graph.add_citation(ids[c.first], ids[c.second]);
+    }
+    result.push_back(timer.per_op(citations.size()));
+
+    timer = Timer();
+    for (int p : probes) {
+        sink += graph.exists(ids[p]);
+    }
+    result.push_back(timer.per_op(n));
+
+    timer = Timer();
+    for (int p : probes) {
+        sink += reinterpret_cast<size_t>(&graph[ids[p]]);
+    }
+    result.push_back(timer.per_op(n));
+
+    timer = Timer();
+    for (int p : probes) {
+        sink += graph.get_children(ids[p]).size();
+    }
+    result.push_back(timer.per_op(n));
+
+    timer = Timer();
+    for (int p : probes) {
+        sink += graph.get_parents(ids[p]).size();
+    }
+    result.push_back(timer.per_op(n));
+
+    timer = Timer();
+    for (auto const &c : citations) {
+        sink += graph.has_citation(ids[c.first], ids[c.second]);
+    }
+    result.push_back(timer.per_op(citations.size()));
+
+    timer = Timer();
+    for (int p : probes) {
+        sink += graph.depth(ids[p]);
+    }
+    result.push_back(timer.per_op(n));
+
+    // Newest first, so that most removals take a small cone
+    timer = Timer();
+    size_t removals = 0;
+    for (int i = n - 1; i > 0; --i) {
+        if (graph.exists(ids[i])) {
+            graph.remove(ids[i]);
+            ++removals;
+        }
+    }
+    result.push_back(timer.per_op(removals));
+    return result;
+}
+
+int main(int argc, char **argv) {
+    int n = argc > 1 ? atoi(argv[1]) : 100000;
+    unsigned seed = argc > 2 ? atoi(argv[2]) : 1;
+
+    vector<const char *> names{IdTraits<int>::name, IdTraits<string>::name, IdTraits<PublicationId>::name,
+                               IdTraits<BigId>::name, IdTraits<CountedId>::name};
+    vector<vector<Cost>> columns{run<int>(n, seed), run<string>(n, seed), run<PublicationId>(n, seed),
+                                 run<BigId>(n, seed), run<CountedId>(n, seed)};
+
+    cout << n << " publications, ns/op" << endl;
+    cout << setw(14) << "";
+    for (const char *name : names) {
+        cout << setw(15) << name;
+    }
+    cout << endl << fixed << setprecision(1);
+    for (size_t op = 0; op < OPERATION_COUNT; ++op) {
+        cout << setw(14) << OPERATIONS[op];
+        for (auto const &column : columns) {
+            cout << setw(15) << column[op].ns;
+        }
+        cout << endl;
+    }
+
+    cout << endl << IdTraits<CountedId>::name << " per op" << endl;
+    cout << setw(14) << "" << setw(15) << "copies" << setw(15) << "comparisons" << endl;
+    for (size_t op = 0; op < OPERATION_COUNT; ++op) {
+        cout << setw(14) << OPERATIONS[op] << setw(15) << columns.back()[op].copies << setw(15)
+             << columns.back()[op].comparisons << endl;
+    }
+
+    // A create costs the same whatever the size of the graph, growth here is a regression
+    cout << endl << "create by graph size, int ids, ns/op" << endl;
+    for (int size : {n, 10 * n}) {
+        CitationGraph<Publication<int>> graph(0);
+        Timer timer;
+        for (int i = 1; i < size; ++i) {
+            graph.create(i, i / 2);
+        }
+        cout << setw(14) << size << setw(15) << timer.per_op(size - 1).ns << endl;
+    }
+    return 0;
+}
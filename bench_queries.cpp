@@ -0,0 +1,117 @@
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <random>
+#include <thread>
+#include <future>
+#include <vector>
+#include <cstdlib>
+#include "citation_graph.h"
+#include "citation_query_scheduler.h"
+#include "Publication.h"
+
+using namespace std;
+
+/**
+ * Query throughput of a CitationGraphHandle under concurrent clients: synchronous calls on
+ * an acquired snapshot against the same queries through a CitationQueryScheduler. Every
+ * client thread keeps window queries in flight, as a front end serving that many requests
+ * would. Queries are random exists, get_children and get_parents.
+ *
+ * Usage: bench_queries [publications] [queries per client] [window], meant for a Release build
+ */
+
+using Graph = CitationGraph<Publication<int>>;
+
+// Keeps the optimizer from dropping query results
+atomic<size_t> sink{0};
+
+template<typename F>
+double queries_per_second(unsigned clients, size_t queries, F client) {
+    auto start = chrono::steady_clock::now();
+    vector<thread> pool;
+    for (unsigned c = 0; c < clients; ++c) {
+        pool.emplace_back(client, c);
+    }
+    for (auto &t : pool) {
+        t.join();
+    }
+    return clients * queries / chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char **argv) {
+    int n = argc > 1 ? atoi(argv[1]) : 1000000;
+    size_t queries = argc > 2 ? atoi(argv[2]) : 200000;
+    size_t window = argc > 3 ? atoi(argv[3]) : 64;
+
+    mt19937 rng(1);
+    Graph graph(0);
+    for (int i = 1; i < n; ++i) {
+        graph.create(i, static_cast<int>(rng() % i));
+        if (rng() % 2 == 0) {
+            graph.add_citation(i, static_cast<int>(rng() % i));
+        }
+    }
+    CitationGraphHandle<Publication<int>> handle(move(graph));
+
+    // Ids past n are misses
+    auto probe = [n](mt19937 &r) { return static_cast<int>(r() % (n + n / 8)); };
+
+    cout << n << " publications, queries/s" << endl;
+    cout << setw(8) << "clients" << setw(14) << "synchronous" << setw(14) << "scheduled" << endl;
+    for (unsigned clients : {1u, 4u, 16u}) {
+        double sync = queries_per_second(clients, queries, [&](unsigned c) {
+            mt19937 r(c);
+            size_t found = 0;
+            for (size_t q = 0; q < queries; ++q) {
+                int id = probe(r);
+                auto snapshot = handle.acquire();
+                switch (q % 3) {
+                    case 0:
+                        found += snapshot->exists(id);
+                        break;
+                    default:
+                        try {
+                            found += q % 3 == 1 ? snapshot->get_children(id).size() : snapshot->get_parents(id).size();
+                        } catch (PublicationNotFound &) {
+                        }
+                }
+            }
+            sink += found;
+        });
+
+        CitationQueryScheduler<Publication<int>> scheduler(handle);
+        double scheduled = queries_per_second(clients, queries, [&](unsigned c) {
+            mt19937 r(c);
+            size_t found = 0;
+            vector<future<bool>> flags;
+            vector<future<vector<int>>> sets;
+            for (size_t q = 0; q < queries;) {
+                for (size_t w = 0; w < window && q < queries; ++w, ++q) {
+                    int id = probe(r);
+                    switch (q % 3) {
+                        case 0:
+                            flags.push_back(scheduler.exists(id));
+                            break;
+                        default:
+                            sets.push_back(q % 3 == 1 ? scheduler.get_children(id) : scheduler.get_parents(id));
+                    }
+                }
+                for (auto &f : flags) {
+                    found += f.get();
+                }
+                for (auto &s : sets) {
+                    try {
+                        found += s.get().size();
+                    } catch (PublicationNotFound &) {
+                    }
+                }
+                flags.clear();
+                sets.clear();
+            }
+            sink += found;
+        });
+        cout << setw(8) << clients << fixed << setprecision(0) << setw(14) << sync << setw(14) << scheduled << endl;
+    }
+    return 0;
+}
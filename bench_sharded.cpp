@@ -0,0 +1,93 @@
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <random>
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <string>
+#include <cstdlib>
+#include "sharded_citation_graph.h"
+#include "Publication.h"
+
+using namespace std;
+
+/**
+ * Operation throughput of a ShardedCitationGraph against its number of shards. Every client
+ * thread creates publications citing earlier ones of any client, adds citations and reads
+ * children, parents and existence, write_percent of its operations being writes. Removals
+ * lock every shard and are left out.
+ *
+ * Usage: bench_sharded [clients] [operations per client] [write percent], meant for a Release build
+ */
+
+using Graph = ShardedCitationGraph<Publication<long>>;
+
+// Keeps the optimizer from dropping query results
+atomic<size_t> sink{0};
+
+int main(int argc, char **argv) {
+    unsigned clients = argc > 1 ? atoi(argv[1]) : 8;
+    long operations = argc > 2 ? atol(argv[2]) : 200000;
+    unsigned write_percent = argc > 3 ? atoi(argv[3]) : 20;
+
+    cout << clients << " clients, " << write_percent << "% writes, operations/s" << endl;
+    cout << setw(8) << "shards" << setw(14) << "throughput" << endl;
+    for (unsigned shards : {1u, 2u, 4u, 8u}) {
+        Graph graph(0, shards);
+        // Client c creates ids c + 1, c + 1 + clients, ..., published ones are below created[c]
+        vector<atomic<long>> created(clients);
+        for (auto &count : created) {
+            count = 0;
+        }
+        auto id_of = [clients](unsigned client, long number) { return 1 + client + number * static_cast<long>(clients); };
+
+        auto start = chrono::steady_clock::now();
+        vector<thread> pool;
+        for (unsigned c = 0; c < clients; ++c) {
+            pool.emplace_back([&, c] {
+                mt19937_64 r(c);
+                size_t found = 0;
+                auto earlier = [&]() -> long {
+                    unsigned other = r() % clients;
+                    long count = created[other].load(memory_order_acquire);
+                    return count == 0 ? 0 : id_of(other, r() % count);
+                };
+                for (long op = 0; op < operations; ++op) {
+                    if (r() % 100 < write_percent) {
+                        long parent = earlier();
+                        if (r() % 4 != 0) {
+                            graph.create(id_of(c, created[c]), {parent, 0});
+                            created[c].fetch_add(1, memory_order_release);
+                        } else if (created[c] > 0) {
+                            // Fails when the publication would cite itself
+                            try {
+                                graph.add_citation(id_of(c, created[c] - 1), parent);
+                            } catch (PublicationNotFound &) {
+                            }
+                        }
+                        continue;
+                    }
+                    long id = earlier();
+                    switch (op % 3) {
+                        case 0:
+                            found += graph.exists(id);
+                            break;
+                        case 1:
+                            found += graph.get_children(id).size();
+                            break;
+                        default:
+                            found += graph.get_parents(id).size();
+                    }
+                }
+                sink += found;
+            });
+        }
+        for (auto &t : pool) {
+            t.join();
+        }
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        cout << setw(8) << shards << fixed << setprecision(0) << setw(14) << clients * operations / seconds << endl;
+    }
+    return 0;
+}
@@ -6,17 +6,29 @@
 #include <set>
 #include <memory>
 #include <map>
+#include <list>
+#include <optional>
+#include <deque>
+#include <limits>
+#include <stdexcept>
+#include <iterator>
+#include <unordered_map>
+#include <unordered_set>
+#include <algorithm>
 #include <ostream>
 #include <iostream>
 #include <ostream>
 #include <cassert>
 #include <sstream>
-
-#ifdef DEBUG
-#define LOG(x) x<<std::endl;
-#else
-#define LOG(x)
-#endif
+#include <cstdint>
+#include <tuple>
+#include <functional>
+#include <cmath>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <exception>
+#include "citation_trace.h"
 
 class PublicationAlreadyCreated : public std::exception {
     char const *what() const noexcept override { return "PublicationAlreadyCreated"; }
@@ -62,11 +74,64 @@ public:
     }
 };
 
+/**
+ * Receives every mutation of a CitationGraph after it has been validated and right before
+ * it commits. An exception thrown from a log_ method rolls the mutation back.
+ */
+template<typename NodeId>
+class CitationLog {
+public:
+    virtual ~CitationLog() = default;
+
+    virtual void log_create(NodeId const &id, std::vector<NodeId> const &parent_ids) = 0;
+
+    virtual void log_citation(NodeId const &child_id, NodeId const &parent_id) = 0;
+
+    virtual void log_remove(NodeId const &id) = 0;
+
+    /**
+     * Bracket the records of a committed CitationGraph::Batch. The records in between belong
+     * together: end_batch(false) means the batch was abandoned and none of them may survive.
+     */
+    virtual void begin_batch() {}
+
+    virtual void end_batch(bool committed) { (void) committed; }
+};
+
+
+// A committed change of a CitationGraph, node events carry their id in parent_id too
+template<typename NodeId>
+struct CitationEvent {
+    enum Type {
+        NODE_CREATED, EDGE_ADDED, NODE_REMOVED
+    };
+    Type type;
+    NodeId id;
+    NodeId parent_id;
+};
+
+/**
+ * Change feed subscriber. Every committed mutation is delivered as one batch: a created node
+ * comes with an EDGE_ADDED event per parent, a removal with a NODE_REMOVED event for every
+ * node that went away in the cascade.
+ */
+template<typename NodeId>
+class CitationObserver {
+public:
+    virtual ~CitationObserver() = default;
+
+    virtual void on_events(std::vector<CitationEvent<NodeId>> const &events) noexcept = 0;
+};
+
+
+template<typename Publication>
+class FrozenCitationGraph;
 
 template<typename Publication>
 class CitationGraph {
 private:
     class Node;
+    class PublicationStore;
 
     template<typename T>
     struct WeakComparator;
@@ -74,7 +139,8 @@ private:
     struct PtrComparator;
 
     using NodeId = typename Publication::id_type;
-    using ParentSet = std::set<Node *>;
+    // Hashed so that an edge can be tested in constant time, see has_citation()
+    using ParentSet = std::unordered_set<Node *>;
     using ChildSet = std::set<std::shared_ptr<Node>, PtrComparator<std::shared_ptr<Node>>>;
     using NodeLookupMap = std::map<NodeId, std::weak_ptr<Node>>;
 
@@ -87,33 +153,124 @@ private:
     };
 
 
+    /**
+     * Cold storage of the publications, nodes only hold the index of their slot. Slots are
+     * allocated in large chunks away from the nodes, so traversals run over compact nodes
+     * whatever the size of Publication. Chunks never move, which keeps references returned
+     * by operator[] valid.
+     */
+    class PublicationStore {
+    private:
+        static constexpr std::size_t CHUNK = 256;
+
+        std::vector<std::unique_ptr<std::optional<Publication>[]>> chunks;
+        std::size_t used = 0;
+        // Capacity never below used, so that release() does not allocate
+        std::vector<std::size_t> free_slots;
+
+        std::optional<Publication> &at(std::size_t slot) const noexcept {
+            return chunks[slot / CHUNK][slot % CHUNK];
+        }
+
+    public:
+        std::size_t acquire(NodeId const &id) {
+            if (!free_slots.empty()) {
+                std::size_t slot = free_slots.back();
+                at(slot).emplace(id);
+                free_slots.pop_back();
+                return slot;
+            }
+            if (free_slots.capacity() <= used) {
+                free_slots.reserve(std::max(used + 1, 2 * free_slots.capacity()));
+            }
+            if (used == chunks.size() * CHUNK) {
+                chunks.push_back(std::make_unique<std::optional<Publication>[]>(CHUNK));
+            }
+            at(used).emplace(id);
+            return used++;
+        }
+
+        void release(std::size_t slot) noexcept {
+            destroy(slot);
+            recycle(slot);
+        }
+
+        // The two halves of release(), destroy() can run concurrently on distinct slots
+        void destroy(std::size_t slot) noexcept {
+            at(slot).reset();
+        }
+
+        void recycle(std::size_t slot) noexcept {
+            free_slots.push_back(slot);
+        }
+
+        Publication const &get(std::size_t slot) const noexcept {
+            return *at(slot);
+        }
+    };
+
     class Node {
     private:
-        Publication value;
         ParentSet parents;
         ChildSet children;
         typename NodeLookupMap::iterator iter;
-        NodeLookupMap &map;
+        NodeLookupMap *map;
+        PublicationStore *store;
         NodeId id;
+        // Acquired last, nothing can throw after it
+        std::size_t slot;
+        bool in_lookup = false;
+        // Cleared when free_nodes() has given the slot back
+        bool in_store = true;
+        bool tombstoned = false;
+        bool queued = false;
+
+        // Longest and shortest citation path from the source
+        std::size_t longest = 0;
+        std::size_t shortest = 0;
+        bool dirty = false;
+        Node *next_dirty = nullptr;
+
+        // Scratch state of collect_cone, reset before it returns
+        bool in_cone = false;
+        std::size_t dead_parents = 0;
+        Node *next_in_cone = nullptr;
+
+        friend class CitationGraph;
 
     public:
-        explicit Node(NodeId id, NodeLookupMap &m) :
-            value(id), parents(), children(), id(id), map(m) {}
+        explicit Node(NodeId const &id, NodeLookupMap *m, PublicationStore *s) :
+            parents(), children(), map(m), store(s), id(id), slot(s->acquire(this->id)) {}
 
 
         virtual ~Node() {
-            LOG(std::cout << "Destruction of node with id: " << id << std::endl);
             for (auto &c: children) {
                 c->parents.erase(this);
             }
             children.clear();
-            map.erase(iter);
+            if (in_lookup) {
+                map->erase(iter);
+            }
+            if (in_store) {
+                store->release(slot);
+            }
         }
 
         void set_lookup_iterator(typename NodeLookupMap::iterator iter) {
             this->iter = iter;
+            this->in_lookup = true;
+        }
+
+        // Drops the lookup entry of a tombstoned node so that its id can be reused
+        void forget_lookup() noexcept {
+            if (in_lookup) {
+                map->erase(iter);
+                in_lookup = false;
+            }
         }
 
+        bool is_tombstoned() const noexcept { return tombstoned; }
+
         typename ParentSet::iterator add_parent(Node *ptr) {
             return parents.emplace(ptr).first;
         }
@@ -122,7 +279,9 @@ private:
             return children.insert(ptr).first;
         }
 
-        const Publication &get_publication() const noexcept { return value; }
+        const Publication &get_publication() const noexcept { return store->get(slot); }
+
+        NodeId const &get_id() const noexcept { return id; }
 
         ParentSet &get_parent_set() noexcept { return parents; }
 
@@ -130,26 +289,252 @@ private:
 
 
         friend std::ostream &operator<<(std::ostream &os, const Node &node) {
-            os << "Node {value= " << &node.value << "}";
+            os << "Node {value= " << &node.get_publication() << "}";
             return os;
         }
 
         bool operator<(const Node &rhs) const {
-            return this->value.get_id() < rhs.value.get_id();
+            return this->id < rhs.id;
         }
     };
 
-    typename NodeLookupMap::const_iterator find_or_throw(NodeId const &id) const {
-        auto node = publication_ids.find(id);
-        if (node == publication_ids.end()) {
+public:
+    enum RemovalMode {
+        IMMEDIATE, DEFERRED, PARALLEL
+    };
+
+    // Outcome of the try_ mutations, each error matches the exception of the throwing variant
+    enum Status {
+        OK, ALREADY_CREATED, NOT_FOUND, ROOT_REMOVAL
+    };
+
+    // Maintained by every mutation, see counters()
+    struct Counters {
+        std::size_t publications;
+        std::size_t citations;
+    };
+
+    /**
+     * Whole graph report of stats(). Citations point from parent to child, so the in-degree
+     * of a publication is its number of parents and the out-degree its number of children.
+     */
+    struct GraphStats {
+        std::size_t publications = 0;
+        std::size_t citations = 0;
+        // Element i is the number of publications of degree i
+        std::vector<std::size_t> in_degrees;
+        std::vector<std::size_t> out_degrees;
+        // Publications with the most children, most first, ties to the smaller id
+        std::vector<std::pair<NodeId, std::size_t>> hubs;
+        // Element i is the number of publications at depth() i and at min_depth() i
+        std::vector<std::size_t> depths;
+        std::vector<std::size_t> min_depths;
+        // Publications other than the root without a parent, empty unless the graph is corrupt
+        std::vector<NodeId> orphans;
+        // No orphans, both ends agree on every citation and the pass matches the counters
+        bool consistent = true;
+    };
+
+private:
+    // Returns nullptr for ids that were never created or are tombstoned
+    Node *find_live(NodeId const &id) const {
+        auto iter = publication_ids->find(id);
+        if (iter == publication_ids->end()) {
+            return nullptr;
+        }
+        Node *node = iter->second.lock().get();
+        return node == nullptr || node->is_tombstoned() ? nullptr : node;
+    }
+
+    static void throw_on_error(Status status) {
+        switch (status) {
+            case ALREADY_CREATED:
+                throw PublicationAlreadyCreated();
+            case NOT_FOUND:
+                throw PublicationNotFound();
+            case ROOT_REMOVAL:
+                throw TriedToRemoveRoot();
+            default:
+                break;
+        }
+    }
+
+    Node *find_or_throw(NodeId const &id) const {
+        Node *node = find_live(id);
+        if (node == nullptr) {
             throw PublicationNotFound();
         }
         return node;
     }
 
-    NodeLookupMap publication_ids;
+    /**
+     * Collects every node that is left without a live parent once removed is detached,
+     * removed included. The result is linked through Node::next_in_cone and every member
+     * has in_cone set. Allocation free, so it never throws.
+     */
+    Node *collect_cone(Node *removed) noexcept {
+        removed->in_cone = true;
+        removed->next_in_cone = nullptr;
+        Node *tail = removed;
+        for (Node *scan = removed; scan != nullptr; scan = scan->next_in_cone) {
+            for (auto &c : scan->children) {
+                Node *child = c.get();
+                if (child->in_cone || child->tombstoned) {
+                    continue;
+                }
+                if (child->dead_parents == 0) {
+                    for (Node *p : child->parents) {
+                        child->dead_parents += p->tombstoned;
+                    }
+                }
+                if (++child->dead_parents == child->parents.size()) {
+                    child->in_cone = true;
+                    child->next_in_cone = nullptr;
+                    tail->next_in_cone = child;
+                    tail = child;
+                }
+            }
+        }
+        for (Node *n = removed; n != nullptr; n = n->next_in_cone) {
+            for (auto &c : n->children) {
+                c->dead_parents = 0;
+            }
+        }
+        return removed;
+    }
+
+    // On the heap, so that nodes can point to it across moves of the graph
+    std::unique_ptr<NodeLookupMap> publication_ids = std::make_unique<NodeLookupMap>();
+    // Declared ahead of the members holding nodes, so that it outlives them
+    std::unique_ptr<PublicationStore> publications = std::make_unique<PublicationStore>();
     std::shared_ptr<Node> source; //TODO does this have to be shared_ptr??
     NodeId source_id;
+    RemovalMode removal_mode = IMMEDIATE;
+    // Workers of RemovalMode::PARALLEL, 0 for one per core, and the cascades they take on
+    unsigned removal_threads = 0;
+    std::size_t parallel_min_cascade = PARALLEL_FREE_MIN;
+    // Detached subgraphs waiting for reclaim(), see RemovalMode::DEFERRED
+    std::vector<std::shared_ptr<Node>> graveyard;
+
+    // The live nodes ordered by id, in flat arrays that batched lookups search, see probe_index()
+    struct ProbeIndex {
+        std::vector<NodeId> ids;
+        std::vector<Node *> nodes;
+    };
+
+    /**
+     * Memoized closures and probe index, valid while version matches the version of the graph.
+     * The closures hold at most max_ids ids, counting one more per closure, and the least
+     * recently used go first, so a graph that never changes does not keep a closure per id.
+     */
+    struct QueryCache {
+        // Which closure of which id, least recently used first
+        using Recency = std::list<std::pair<bool, NodeId>>;
+
+        struct Closure {
+            std::vector<NodeId> ids;
+            typename Recency::iterator use;
+        };
+
+        std::mutex mutex;
+        std::uint64_t version = 0;
+        std::map<NodeId, Closure> ancestors;
+        std::map<NodeId, Closure> descendants;
+        Recency recency;
+        std::size_t cached_ids = 0;
+        std::size_t max_ids = QUERY_CACHE_IDS;
+        std::shared_ptr<const ProbeIndex> index;
+        // Ids looked up by resolve_many() in this version
+        std::size_t probes = 0;
+
+        void expire(std::uint64_t current) {
+            if (version != current) {
+                ancestors.clear();
+                descendants.clear();
+                recency.clear();
+                cached_ids = 0;
+                index.reset();
+                probes = 0;
+                version = current;
+            }
+        }
+
+        std::vector<NodeId> const *find(NodeId const &id, bool upwards) {
+            auto &closures = upwards ? ancestors : descendants;
+            auto hit = closures.find(id);
+            if (hit == closures.end()) {
+                return nullptr;
+            }
+            recency.splice(recency.end(), recency, hit->second.use);
+            return &hit->second.ids;
+        }
+
+        void insert(NodeId const &id, bool upwards, std::vector<NodeId> const &ids) {
+            auto &closures = upwards ? ancestors : descendants;
+            if (ids.size() >= max_ids || closures.count(id) != 0) {
+                return;
+            }
+            shrink(max_ids - ids.size() - 1);
+            recency.emplace_back(upwards, id);
+            try {
+                closures.emplace(id, Closure{ids, std::prev(recency.end())});
+            } catch (...) {
+                recency.pop_back();
+                throw;
+            }
+            cached_ids += ids.size() + 1;
+        }
+
+        // Evicts the least recently used closures until at most limit ids are left
+        void shrink(std::size_t limit) noexcept {
+            while (cached_ids > limit) {
+                auto &closures = recency.front().first ? ancestors : descendants;
+                auto victim = closures.find(recency.front().second);
+                cached_ids -= victim->second.ids.size() + 1;
+                closures.erase(victim);
+                recency.pop_front();
+            }
+        }
+    };
+
+    // Bumped by every mutation that changes the observable graph
+    std::uint64_t version = 0;
+    // Not owned, see set_log()
+    CitationLog<NodeId> *log = nullptr;
+    // Not owned, see subscribe()
+    std::vector<CitationObserver<NodeId> *> observers;
+    // Number of live publications per generation, i.e. longest path from the source
+    std::vector<std::size_t> generations{1};
+    // Live publications and the citations between them, see counters()
+    std::size_t live_publications = 1;
+    std::size_t live_citations = 0;
+    std::unique_ptr<QueryCache> query_cache = std::make_unique<QueryCache>();
+
+    // A mutation of the open batch with what it took out of the graph, see begin_batch()
+    struct UndoRecord {
+        enum Type {
+            CREATED, CITED, REMOVED
+        };
+        Type type = CREATED;
+        // The created, citing or removed node
+        std::shared_ptr<Node> node;
+        Node *parent = nullptr;
+        // The ids a create was given, kept only while a log or observers listen
+        std::vector<NodeId> parent_ids;
+        // Tombstone whose lookup entry a create took over
+        std::shared_ptr<Node> evicted;
+        // The cone of a removal and the child set entries of the removed node with their owners
+        std::vector<Node *> cone;
+        std::vector<typename ChildSet::node_type> detached;
+        std::vector<Node *> detached_from;
+        // Scratch space of undo(), one child set position per parent
+        std::vector<typename ChildSet::iterator> entries;
+        // Citations that the removal took out of the graph
+        std::size_t citations = 0;
+    };
+
+    std::vector<UndoRecord> undo_log;
+    bool batching = false;
 
 
     //TODO replace with dereferencing struct template, integrate with comparators too
@@ -159,7 +544,7 @@ private:
         vec.reserve(s.size());
         for (auto &elem: s) {
             auto &drf = *elem;
-            vec.push_back(drf.get_publication().get_id());
+            vec.push_back(drf.id);
         }
         return vec;
     }
@@ -168,168 +553,2480 @@ private:
         std::vector<NodeId> vec;
         vec.reserve(s.size());
         for (auto *ptr: s) {
-            vec.push_back(ptr->get_publication().get_id());
+            if (!ptr->is_tombstoned()) {
+                vec.push_back(ptr->id);
+            }
         }
         return vec;
     }
 
-public:
+    // Dense snapshot of the live graph, node i is nodes[i] and nodes are ordered by id
+    struct Topology {
+        std::vector<Node *> nodes;
+        // Children of i are targets[offsets[i]] .. targets[offsets[i + 1] - 1]
+        std::vector<std::size_t> offsets;
+        std::vector<std::size_t> targets;
+        std::size_t source;
+    };
 
-    explicit CitationGraph(NodeId const &stem_id) : source_id(stem_id) {
-        std::shared_ptr<Node> root = std::make_shared<Node>(stem_id, publication_ids);
-        auto iter = publication_ids.insert(publication_ids.begin(), std::make_pair(stem_id, root));
-        root->set_lookup_iterator(iter);
-        this->source = root;
+    Topology snapshot_topology() const {
+        Topology t;
+        t.nodes.reserve(publication_ids->size());
+        std::unordered_map<Node const *, std::size_t> index;
+        index.reserve(publication_ids->size());
+        for (auto &pair : *publication_ids) {
+            Node *node = pair.second.lock().get();
+            if (!node->is_tombstoned()) {
+                index.emplace(node, t.nodes.size());
+                t.nodes.push_back(node);
+            }
+        }
+        t.offsets.reserve(t.nodes.size() + 1);
+        t.offsets.push_back(0);
+        for (Node *node : t.nodes) {
+            for (auto &c : node->children) {
+                t.targets.push_back(index.find(c.get())->second);
+            }
+            t.offsets.push_back(t.targets.size());
+        }
+        t.source = index.find(source.get())->second;
+        return t;
     }
 
-    CitationGraph(CitationGraph<Publication> &&other) noexcept
-        : publication_ids(), source(nullptr), source_id(other.stem_id) {
-        *this = std::move(other);
+    // Kahn's algorithm from the source, every live node is reachable from it
+    static std::vector<std::size_t> topological_order(Topology const &t) {
+        std::vector<std::size_t> in_degree(t.nodes.size(), 0);
+        for (std::size_t target : t.targets) {
+            ++in_degree[target];
+        }
+        std::vector<std::size_t> order{t.source};
+        order.reserve(t.nodes.size());
+        for (std::size_t i = 0; i < order.size(); ++i) {
+            std::size_t v = order[i];
+            for (std::size_t e = t.offsets[v]; e < t.offsets[v + 1]; ++e) {
+                if (--in_degree[t.targets[e]] == 0) {
+                    order.push_back(t.targets[e]);
+                }
+            }
+        }
+        return order;
     }
 
-    CitationGraph<Publication> &operator=(CitationGraph<Publication> &&other) noexcept {
-        std::swap(this->publication_ids, std::move(other.publication_ids));
-        std::swap(this->source, std::move(other.source));
-        std::swap(this->source_id, std::move(other.source_id));
+    // Room for extra more elements, growing geometrically, as reserve() alone would not
+    template<typename T>
+    static void reserve_more(std::vector<T> &v, std::size_t extra) {
+        if (v.capacity() - v.size() < extra) {
+            v.reserve(std::max(v.size() + extra, 2 * v.capacity()));
+        }
     }
 
-    NodeId get_root_id() const {
-        return this->source_id;
+    static unsigned worker_count(unsigned threads, std::size_t jobs) {
+        if (threads == 0) {
+            threads = std::max(1u, std::thread::hardware_concurrency());
+        }
+        return static_cast<unsigned>(std::max<std::size_t>(1, std::min<std::size_t>(threads, jobs)));
     }
 
-    std::vector<NodeId> get_children(NodeId const &id) const {
-        ChildSet &c = find_or_throw(id)->second.lock()->get_child_set();
-        return to_vector(c);
+    /**
+     * Runs work(worker) for every worker in [0, workers). The calling thread takes worker 0
+     * and those whose threads could not be started. The first exception of a worker is
+     * rethrown once all of them have finished.
+     */
+    template<typename F>
+    static void run_workers(unsigned workers, F work) {
+        std::vector<std::exception_ptr> failures(workers);
+        auto guarded = [&](unsigned worker) {
+            try {
+                work(worker);
+            } catch (...) {
+                failures[worker] = std::current_exception();
+            }
+        };
+        std::vector<std::thread> pool;
+        unsigned started = 1;
+        try {
+            pool.reserve(workers);
+            for (; started < workers; ++started) {
+                pool.emplace_back(guarded, started);
+            }
+        } catch (...) {
+        }
+        guarded(0);
+        for (unsigned w = started; w < workers; ++w) {
+            guarded(w);
+        }
+        for (auto &thread : pool) {
+            thread.join();
+        }
+        for (auto &failure : failures) {
+            if (failure != nullptr) {
+                std::rethrow_exception(failure);
+            }
+        }
     }
 
-    std::vector<NodeId> get_parents(NodeId const &id) const {
-        ParentSet &a = find_or_throw(id)->second.lock()->get_parent_set();
-        return to_vector_parent(a);
+    /**
+     * Runs work(begin, end) over [0, jobs) in chunks taken by up to workers threads, after
+     * the calling thread has run first(). Never throws: threads that cannot be started leave
+     * their chunks to the others.
+     */
+    template<typename F, typename G>
+    static void run_chunks(unsigned workers, std::size_t jobs, F work, G first) noexcept {
+        static constexpr std::size_t CHUNK = 256;
+        std::atomic<std::size_t> next{0};
+        auto take = [&]() {
+            for (std::size_t begin; (begin = next.fetch_add(CHUNK)) < jobs;) {
+                work(begin, std::min(begin + CHUNK, jobs));
+            }
+        };
+        std::vector<std::thread> pool;
+        try {
+            pool.reserve(workers);
+            for (unsigned w = 1; w < workers; ++w) {
+                pool.emplace_back(take);
+            }
+        } catch (...) {
+        }
+        first();
+        take();
+        for (auto &thread : pool) {
+            thread.join();
+        }
     }
 
-    bool exists(NodeId const &id) const {
-        auto iter = publication_ids.find(id);
-        return iter != publication_ids.end() && !(*iter).second.expired();
+    // Cascades this deep are freed by free_nodes(), ~Node would recurse as deep
+    static constexpr std::size_t DEEP_FREE_MIN = 4096;
+    // Default size of the cascades freed by the workers of RemovalMode::PARALLEL
+    static constexpr std::size_t PARALLEL_FREE_MIN = 1 << 15;
+    // Nodes per worker of a parallel free_nodes()
+    static constexpr std::size_t PARALLEL_FREE_PER_WORKER = 1 << 14;
+    // Publications per worker of stats()
+    static constexpr std::size_t STATS_PER_WORKER = 1 << 14;
+    // Default bound on the ids held by memoized closures, see set_query_cache_limit()
+    static constexpr std::size_t QUERY_CACHE_IDS = 1 << 22;
+
+    /**
+     * Frees doomed, whose members have in_cone set, without recursing through ~Node, which
+     * would overflow the stack on a long citation chain. The nodes must not be reachable
+     * from anything but each other and doomed, apart from edges to nodes outside doomed, and
+     * no other tombstone may exist.
+     * Child sets are emptied first, with edges leaving doomed unlinked under striped locks,
+     * since doomed nodes share children. The lookup map and the free slot list are updated
+     * by the calling thread meanwhile. Once the nodes are bare, releasing doomed frees them.
+     */
+    void free_nodes(std::vector<std::shared_ptr<Node>> &doomed, unsigned workers) noexcept {
+        static constexpr std::size_t STRIPES = 64;
+        std::mutex stripes[STRIPES];
+        PublicationStore *store = publications.get();
+        run_chunks(workers, doomed.size(), [&](std::size_t begin, std::size_t end) {
+            for (std::size_t i = begin; i < end; ++i) {
+                Node *n = doomed[i].get();
+                for (auto &c : n->children) {
+                    if (!c->in_cone) {
+                        std::lock_guard<std::mutex> lock(
+                            stripes[reinterpret_cast<std::uintptr_t>(c.get()) / alignof(Node) % STRIPES]);
+                        c->parents.erase(n);
+                    }
+                }
+                n->children.clear();
+                store->destroy(n->slot);
+            }
+        }, [&]() {
+            for (auto const &n : doomed) {
+                n->forget_lookup();
+                store->recycle(n->slot);
+                n->in_store = false;
+            }
+        });
+        run_chunks(workers, doomed.size(), [&](std::size_t begin, std::size_t end) {
+            for (std::size_t i = begin; i < end; ++i) {
+                doomed[i].reset();
+            }
+        }, []() {});
+        doomed.clear();
     }
 
-    const Publication &operator[](NodeId const &id) const {
-        return find_or_throw(id)->second.lock()->get_publication();
+    std::vector<std::pair<NodeId, std::size_t>>
+    top_by_score(Topology const &t, std::vector<std::size_t> const &scores, std::size_t k) const {
+        std::vector<std::size_t> candidates;
+        candidates.reserve(t.nodes.size());
+        for (std::size_t v = 0; v < t.nodes.size(); ++v) {
+            if (v != t.source) {
+                candidates.push_back(v);
+            }
+        }
+        k = std::min(k, candidates.size());
+        // Ties go to the smaller id, which is the smaller index
+        std::partial_sort(candidates.begin(), candidates.begin() + k, candidates.end(),
+                          [&scores](std::size_t a, std::size_t b) {
+                              return scores[a] != scores[b] ? scores[a] > scores[b] : a < b;
+                          });
+        std::vector<std::pair<NodeId, std::size_t>> result;
+        result.reserve(k);
+        for (std::size_t i = 0; i < k; ++i) {
+            result.emplace_back(t.nodes[candidates[i]]->id, scores[candidates[i]]);
+        }
+        return result;
     }
 
-    void create(NodeId const &id, NodeId const &parent_id) {
-        create(id, std::vector<NodeId>(1, parent_id));
+    void publish(std::vector<CitationEvent<NodeId>> const &events) const noexcept {
+        if (events.empty()) {
+            return;
+        }
+        for (CitationObserver<NodeId> *observer : observers) {
+            observer->on_events(events);
+        }
     }
 
-    void create(NodeId const &id, std::vector<NodeId> const &parent_ids) {
-        if (publication_ids.find(id) != publication_ids.end()) {
-            throw PublicationAlreadyCreated();
+    // Intrusive FIFO of nodes whose depths have to be recomputed, never allocates
+    struct DepthWorklist {
+        Node *head = nullptr;
+        Node *tail = nullptr;
+
+        void push(Node *n) noexcept {
+            if (n->dirty) {
+                return;
+            }
+            n->dirty = true;
+            n->next_dirty = nullptr;
+            (tail == nullptr ? head : tail->next_dirty) = n;
+            tail = n;
         }
 
-        if (parent_ids.empty()) {
-            throw PublicationNotFound();
+        Node *pop() noexcept {
+            Node *n = head;
+            if (n != nullptr) {
+                head = n->next_dirty;
+                tail = head == nullptr ? nullptr : tail;
+                n->dirty = false;
+            }
+            return n;
         }
+    };
 
-        Transaction<ChildSet> c_trans;
-        Transaction<ParentSet> p_trans;
-        Transaction<NodeLookupMap> nl_trans;
+    // Depths of n implied by its live parents, the source has no parents and stays at 0
+    static std::pair<std::size_t, std::size_t> depths_from_parents(Node const *n) noexcept {
+        std::size_t longest = 0;
+        std::size_t shortest = SIZE_MAX;
+        for (Node const *p : n->parents) {
+            if (!p->tombstoned) {
+                longest = std::max(longest, p->longest + 1);
+                shortest = std::min(shortest, p->shortest + 1);
+            }
+        }
+        return {longest, shortest == SIZE_MAX ? 0 : shortest};
+    }
 
-        std::shared_ptr<Node> child = std::make_shared<Node>(id, publication_ids);
-        auto lookup_iterator = publication_ids.insert(
-            publication_ids.begin(),
-            std::make_pair(id, child));
-        nl_trans.record_addition(publication_ids, lookup_iterator);
-        for (NodeId parent_id : parent_ids) {
-            if (parent_id == id) {
-                throw PublicationNotFound();
+    /**
+     * Recomputes queued nodes and pushes the children of every node whose depths changed.
+     * The caller reserves generations for the deepest level that can appear.
+     */
+    void settle_depths(DepthWorklist &work) noexcept {
+        while (Node *n = work.pop()) {
+            auto depths = depths_from_parents(n);
+            if (depths.first == n->longest && depths.second == n->shortest) {
+                continue;
             }
-            auto parent_iter = publication_ids.find(parent_id);
-            if (parent_iter == publication_ids.end()) {
-                throw PublicationNotFound();
+            --generations[n->longest];
+            if (depths.first >= generations.size()) {
+                generations.resize(depths.first + 1);
             }
-            std::shared_ptr<Node> parent = (*parent_iter).second.lock();
-            auto c_iter = parent->add_child(child);
-            auto p_iter = child->add_parent(parent.get());
-            c_trans.record_addition(parent->get_child_set(), c_iter);
-            p_trans.record_addition(child->get_parent_set(), p_iter);
+            ++generations[depths.first];
+            n->longest = depths.first;
+            n->shortest = depths.second;
+            for (auto &c : n->children) {
+                work.push(c.get());
+            }
+        }
+        while (generations.size() > 1 && generations.back() == 0) {
+            generations.pop_back();
         }
+    }
 
-        child->set_lookup_iterator(lookup_iterator);
-        nl_trans.commit();
-        p_trans.commit();
-        c_trans.commit();
+    /**
+     * Puts back what r took out of the graph. Strong guarantee: comparisons of ids and the
+     * allocation of a create's scratch space may throw, but they all come before the first
+     * change.
+     */
+    void undo(UndoRecord &r) {
+        Node *n = r.node.get();
+        DepthWorklist work;
+        switch (r.type) {
+            case UndoRecord::CREATED: {
+                r.entries.clear();
+                r.entries.reserve(n->parents.size());
+                for (Node *p : n->parents) {
+                    r.entries.push_back(p->children.find(r.node));
+                }
+                std::size_t i = 0;
+                for (Node *p : n->parents) {
+                    p->children.erase(r.entries[i++]);
+                }
+                --live_publications;
+                live_citations -= n->parents.size();
+                n->parents.clear();
+                --generations[n->longest];
+                if (r.evicted != nullptr) {
+                    n->iter->second = r.evicted;
+                    n->in_lookup = false;
+                    r.evicted->in_lookup = true;
+                } else {
+                    n->forget_lookup();
+                }
+                break;
+            }
+            case UndoRecord::CITED:
+                r.parent->children.erase(r.parent->children.find(r.node));
+                n->parents.erase(r.parent);
+                --live_citations;
+                work.push(n);
+                break;
+            case UndoRecord::REMOVED: {
+                // Capacity reserved by remove, a failed insertion takes the earlier ones back out
+                r.entries.clear();
+                std::size_t i = 0;
+                try {
+                    for (; i < r.detached.size(); ++i) {
+                        r.entries.push_back(r.detached_from[i]->children.insert(std::move(r.detached[i])).position);
+                    }
+                } catch (...) {
+                    while (i-- > 0) {
+                        r.detached[i] = r.detached_from[i]->children.extract(r.entries[i]);
+                    }
+                    throw;
+                }
+                // Never deeper than before the removal, the capacity of generations suffices
+                for (Node *c : r.cone) {
+                    c->tombstoned = false;
+                    if (c->longest >= generations.size()) {
+                        generations.resize(c->longest + 1);
+                    }
+                    ++generations[c->longest];
+                    ++live_publications;
+                }
+                live_citations += r.citations;
+                for (Node *c : r.cone) {
+                    for (auto &child : c->children) {
+                        if (!child->tombstoned) {
+                            work.push(child.get());
+                        }
+                    }
+                }
+                break;
+            }
+        }
+        settle_depths(work);
+    }
 
+    // Undoes the records one at a time, if one fails it and those before it stay in the log
+    void rollback_to(std::size_t savepoint) {
+        if (undo_log.size() <= savepoint) {
+            return;
+        }
+        TraceScope trace(TraceRecord::BATCH_ROLLBACK);
+        std::size_t records = undo_log.size() - savepoint;
+        ++version;
+        while (undo_log.size() > savepoint) {
+            undo(undo_log.back());
+            undo_log.pop_back();
+        }
+        trace.finish(OK, records);
     }
 
+    /**
+     * Hands the open batch to the log, as one bracketed group, and to the observers. If the
+     * log fails the batch stays open and untouched.
+     */
+    void commit_batch() {
+        TraceScope trace(TraceRecord::BATCH_COMMIT);
+        std::size_t removals = 0;
+        for (UndoRecord const &r : undo_log) {
+            removals += r.type == UndoRecord::REMOVED;
+        }
+        if (removal_mode == DEFERRED) {
+            reserve_more(graveyard, removals);
+        }
+        // The cones go to free_nodes() when remove_cone() would send them there, all at once,
+        // since a cone may hold children of another. They are the only tombstones.
+        std::vector<std::shared_ptr<Node>> doomed;
+        bool free_deep = false;
+        if (removal_mode != DEFERRED && graveyard.empty()) {
+            std::size_t size = 0;
+            for (UndoRecord const &r : undo_log) {
+                if (r.type == UndoRecord::REMOVED) {
+                    size += r.cone.size();
+                    for (Node *n : r.cone) {
+                        free_deep = free_deep || n->longest - r.node->longest >= DEEP_FREE_MIN;
+                    }
+                }
+            }
+            free_deep = free_deep || (removal_mode == PARALLEL && size >= parallel_min_cascade);
+            if (free_deep) {
+                doomed.reserve(size);
+            }
+        }
+        // Creates made while nothing listened kept no parent ids. Their parents stand in, less
+        // the ones cited later in the batch, which have records of their own.
+        if (log != nullptr || !observers.empty()) {
+            std::set<std::pair<Node *, Node *>> cited;
+            for (auto r = undo_log.rbegin(); r != undo_log.rend(); ++r) {
+                if (r->type == UndoRecord::CITED) {
+                    cited.emplace(r->node.get(), r->parent);
+                } else if (r->type == UndoRecord::CREATED && r->parent_ids.empty()) {
+                    for (Node *p : r->node->parents) {
+                        if (cited.count({r->node.get(), p}) == 0) {
+                            r->parent_ids.push_back(p->id);
+                        }
+                    }
+                }
+            }
+        }
+        std::vector<CitationEvent<NodeId>> events;
+        if (!observers.empty()) {
+            for (UndoRecord const &r : undo_log) {
+                NodeId const &id = r.node->id;
+                if (r.type == UndoRecord::CREATED) {
+                    events.push_back({CitationEvent<NodeId>::NODE_CREATED, id, id});
+                    for (auto p = r.parent_ids.begin(); p != r.parent_ids.end(); ++p) {
+                        if (std::find(r.parent_ids.begin(), p, *p) == p) {
+                            events.push_back({CitationEvent<NodeId>::EDGE_ADDED, id, *p});
+                        }
+                    }
+                } else if (r.type == UndoRecord::CITED) {
+                    events.push_back({CitationEvent<NodeId>::EDGE_ADDED, id, r.parent->id});
+                } else {
+                    for (Node *c : r.cone) {
+                        events.push_back({CitationEvent<NodeId>::NODE_REMOVED, c->id, c->id});
+                    }
+                }
+            }
+        }
+        if (log != nullptr) {
+            log->begin_batch();
+            try {
+                for (UndoRecord const &r : undo_log) {
+                    if (r.type == UndoRecord::CREATED) {
+                        log->log_create(r.node->id, r.parent_ids);
+                    } else if (r.type == UndoRecord::CITED) {
+                        log->log_citation(r.node->id, r.parent->id);
+                    } else {
+                        log->log_remove(r.node->id);
+                    }
+                }
+                log->end_batch(true);
+            } catch (...) {
+                log->end_batch(false);
+                throw;
+            }
+        }
 
-    void add_citation(NodeId const &child_id, NodeId const &parent_id) {
-        typename NodeLookupMap::iterator child_iter = publication_ids.find(child_id);
-        typename NodeLookupMap::iterator parent_iter = publication_ids.find(parent_id);
-        if (child_iter == publication_ids.end() ||
-            parent_iter == publication_ids.end() || child_id == parent_id) {
-            throw PublicationNotFound();
+        for (UndoRecord &r : undo_log) {
+            if (r.type == UndoRecord::REMOVED && removal_mode == DEFERRED) {
+                r.node->queued = true;
+                graveyard.push_back(std::move(r.node));
+            } else if (r.type == UndoRecord::REMOVED && free_deep) {
+                r.node->in_cone = true;
+                doomed.push_back(r.node);
+            }
+        }
+        if (free_deep) {
+            // The capacity reserved above is the size of all cones
+            for (std::size_t i = 0; i < doomed.size(); ++i) {
+                for (auto &c : doomed[i]->children) {
+                    if (c->tombstoned && !c->in_cone) {
+                        c->in_cone = true;
+                        doomed.push_back(c);
+                    }
+                }
+            }
+            free_nodes(doomed, removal_mode == PARALLEL
+                               ? worker_count(removal_threads, doomed.size() / PARALLEL_FREE_PER_WORKER) : 1);
         }
+        trace.finish(OK, undo_log.size());
+        // Nodes that free_nodes() stripped go with the records that still refer to them
+        undo_log.clear();
+        batching = false;
+        publish(events);
+    }
 
-        Transaction<ChildSet> c_trans;
-        Transaction<ParentSet> p_trans;
+    // Full recomputation, used when a graph is built in bulk
+    void reset_depths() {
+        Topology t = snapshot_topology();
+        live_publications = t.nodes.size();
+        live_citations = t.targets.size();
+        generations.assign(1, 0);
+        for (std::size_t v : topological_order(t)) {
+            Node *n = t.nodes[v];
+            std::tie(n->longest, n->shortest) = depths_from_parents(n);
+            if (n->longest >= generations.size()) {
+                generations.resize(n->longest + 1);
+            }
+            ++generations[n->longest];
+        }
+    }
 
-        std::shared_ptr<Node> parent = parent_iter->second.lock();
-        std::shared_ptr<Node> child = child_iter->second.lock();
-        p_trans.record_addition(child->get_parent_set(), child->add_parent(parent.get()));
-        c_trans.record_addition(parent->get_child_set(), parent->add_child(child));
+    /**
+     * Resolves many ids in one pass: the requests are visited in id order, so the walk over
+     * the lookup map moves forward only and consecutive probes share the cached upper levels
+     * of the tree. Nearby keys are reached by stepping, far ones by lower_bound. Once the
+     * probe index of the graph pays off, it is searched instead, see probe_index().
+     * Element i is the live node of ids[i] or nullptr.
+     */
+    std::vector<Node *> resolve_many(std::vector<NodeId> const &ids) const {
+        if (std::shared_ptr<const ProbeIndex> index = probe_index(ids.size())) {
+            return search_index(*index, ids);
+        }
+        std::vector<std::size_t> order(ids.size());
+        for (std::size_t i = 0; i < order.size(); ++i) {
+            order[i] = i;
+        }
+        std::sort(order.begin(), order.end(), [&ids](std::size_t a, std::size_t b) { return ids[a] < ids[b]; });
+
+        std::vector<Node *> nodes(ids.size(), nullptr);
+        auto iter = publication_ids->begin();
+        for (std::size_t i = 0; i < order.size(); ++i) {
+            NodeId const &id = ids[order[i]];
+            if (i > 0 && !(ids[order[i - 1]] < id)) {
+                nodes[order[i]] = nodes[order[i - 1]];
+                continue;
+            }
+            for (int step = 0; step < 4 && iter != publication_ids->end() && iter->first < id; ++step) {
+                ++iter;
+            }
+            if (iter != publication_ids->end() && iter->first < id) {
+                iter = publication_ids->lower_bound(id);
+            }
+            if (iter != publication_ids->end() && !(id < iter->first)) {
+                Node *node = iter->second.lock().get();
+                nodes[order[i]] = node == nullptr || node->is_tombstoned() ? nullptr : node;
+            }
+        }
+        return nodes;
+    }
 
-        c_trans.commit();
-        p_trans.commit();
+    // An index pays for itself once lookups have probed this fraction of the ids, see probe_index()
+    static constexpr std::size_t INDEX_PAYBACK = 16;
+    // Binary searches that search_index() runs in lockstep
+    static constexpr std::size_t PROBE_GROUP = 16;
+
+    /**
+     * Index of the current version, nullptr until the lookups of resolve_many() have probed a
+     * INDEX_PAYBACK-th as many ids as there are publications. Each probe of the map is a chain
+     * of dependent cache misses, while the index is built in one walk and then searched many
+     * probes at a time. The index takes a copy of every id and lasts until the next mutation,
+     * so it helps graphs that are queried for long without change, such as the snapshots of
+     * a CitationGraphHandle.
+     */
+    std::shared_ptr<const ProbeIndex> probe_index(std::size_t probes) const {
+        {
+            std::lock_guard<std::mutex> lock(query_cache->mutex);
+            query_cache->expire(version);
+            if (query_cache->index != nullptr) {
+                return query_cache->index;
+            }
+            query_cache->probes += probes;
+            if (query_cache->probes * INDEX_PAYBACK < live_publications) {
+                return nullptr;
+            }
+        }
+        // Readers that get here together build it each, the first one keeps it
+        auto index = std::make_shared<ProbeIndex>();
+        index->ids.reserve(live_publications);
+        index->nodes.reserve(live_publications);
+        for (auto &pair : *publication_ids) {
+            Node *node = pair.second.lock().get();
+            if (!node->is_tombstoned()) {
+                index->ids.push_back(pair.first);
+                index->nodes.push_back(node);
+            }
+        }
+        std::lock_guard<std::mutex> lock(query_cache->mutex);
+        if (query_cache->index == nullptr) {
+            query_cache->index = std::move(index);
+        }
+        return query_cache->index;
     }
 
-    void remove(NodeId const &base_remove_id) {
-        auto map_iter = publication_ids.find(base_remove_id);
-        if (map_iter == publication_ids.end()) {
-            throw PublicationNotFound();
+    /**
+     * Element i is the node of ids[i] or nullptr. Branch free binary searches, PROBE_GROUP of
+     * them at a time: searches of one group take the same number of steps, so they advance
+     * together, and each one's next probe is prefetched a whole round of the others ahead of
+     * its comparison.
+     */
+    static std::vector<Node *> search_index(ProbeIndex const &index, std::vector<NodeId> const &ids) {
+        std::vector<Node *> nodes(ids.size(), nullptr);
+        std::size_t size = index.ids.size();
+        std::size_t base[PROBE_GROUP];
+        for (std::size_t first = 0; first < ids.size(); first += PROBE_GROUP) {
+            std::size_t group = std::min(PROBE_GROUP, ids.size() - first);
+            std::fill(base, base + group, 0);
+            for (std::size_t length = size; length > 1;) {
+                std::size_t half = length / 2;
+                length -= half;
+                for (std::size_t g = 0; g < group; ++g) {
+                    base[g] = index.ids[base[g] + half] < ids[first + g] ? base[g] + half : base[g];
+                    __builtin_prefetch(&index.ids[base[g] + length / 2]);
+                }
+            }
+            for (std::size_t g = 0; g < group; ++g) {
+                std::size_t i = base[g] + (index.ids[base[g]] < ids[first + g]);
+                if (i < size && !(ids[first + g] < index.ids[i])) {
+                    nodes[first + g] = index.nodes[i];
+                }
+            }
         }
-        if (base_remove_id == source_id) {
-            throw TriedToRemoveRoot();
+        return nodes;
+    }
+
+    // Queries this far apart have their cache misses in flight together, see neighbours_many()
+    static constexpr std::size_t PREFETCH_DISTANCE = 8;
+
+    /**
+     * Children or parents of many ids. Past the lookup, reading a set misses on the node, on
+     * the first element of the set and on the node that element points to. These are
+     * prefetched for the queries PREFETCH_DISTANCE, a half and a quarter of it places ahead,
+     * each once the one before has arrived, so independent queries overlap their misses
+     * instead of taking them one after the other.
+     */
+    std::vector<std::optional<std::vector<NodeId>>> neighbours_many(std::vector<NodeId> const &ids, bool children) const {
+        std::vector<Node *> nodes = resolve_many(ids);
+        auto prefetch_node = [&](std::size_t i) {
+            if (i < nodes.size() && nodes[i] != nullptr) {
+                __builtin_prefetch(nodes[i]);
+            }
+        };
+        // The set headers live in the nodes
+        auto prefetch_element = [&](std::size_t i) {
+            Node const *n = i < nodes.size() ? nodes[i] : nullptr;
+            if (n != nullptr && children && !n->children.empty()) {
+                __builtin_prefetch(&*n->children.begin());
+            } else if (n != nullptr && !children && !n->parents.empty()) {
+                __builtin_prefetch(&*n->parents.begin());
+            }
+        };
+        auto prefetch_neighbour = [&](std::size_t i) {
+            Node const *n = i < nodes.size() ? nodes[i] : nullptr;
+            if (n != nullptr && children && !n->children.empty()) {
+                __builtin_prefetch(n->children.begin()->get());
+            } else if (n != nullptr && !children && !n->parents.empty()) {
+                __builtin_prefetch(*n->parents.begin());
+            }
+        };
+        for (std::size_t i = 0; i < PREFETCH_DISTANCE; ++i) {
+            prefetch_node(i);
+        }
+        for (std::size_t i = 0; i < PREFETCH_DISTANCE / 2; ++i) {
+            prefetch_element(i);
+        }
+        for (std::size_t i = 0; i < PREFETCH_DISTANCE / 4; ++i) {
+            prefetch_neighbour(i);
         }
 
-        Transaction<ChildSet> t;
+        std::vector<std::optional<std::vector<NodeId>>> result(nodes.size());
+        for (std::size_t i = 0; i < nodes.size(); ++i) {
+            prefetch_node(i + PREFETCH_DISTANCE);
+            prefetch_element(i + PREFETCH_DISTANCE / 2);
+            prefetch_neighbour(i + PREFETCH_DISTANCE / 4);
+            if (nodes[i] != nullptr) {
+                result[i] = children ? to_vector(nodes[i]->children) : to_vector_parent(nodes[i]->parents);
+            }
+        }
+        return result;
+    }
 
-        auto node = (*map_iter).second.lock();
-        for (auto &p : node->get_parent_set()) {
-            auto i = p->get_child_set().find(node);
-            assert(i != p->get_child_set().end());
-            t.record_removal(p->get_child_set(), i);
+    // Counts the members of the smaller of the two sets that the other one also holds
+    static std::size_t shared_citers(Node const *a, Node const *b) noexcept {
+        if (a->children.size() > b->children.size()) {
+            std::swap(a, b);
+        }
+        std::size_t shared = 0;
+        for (auto &c : a->children) {
+            shared += c->parents.count(const_cast<Node *>(b));
         }
+        return shared;
+    }
 
-        t.commit();
+    static std::size_t shared_references(Node const *a, Node const *b) noexcept {
+        if (a->parents.size() > b->parents.size()) {
+            std::swap(a, b);
+        }
+        std::size_t shared = 0;
+        for (Node *p : a->parents) {
+            shared += !p->tombstoned && b->parents.count(p) != 0;
+        }
+        return shared;
     }
 
-    friend std::ostream &operator<<(std::ostream &os, const CitationGraph &cg) {
-        for (auto &pair : cg.publication_ids) {
-            std::shared_ptr<Node> node = (pair.second.lock());
-            os << "Children of " << pair.first << ": ";
-            for (auto const &c : node->get_child_set()) {
-                os << c->get_publication().get_id() << " ";
+    /**
+     * Scores a against every node of others in one sweep over the two-hop neighbourhood of a,
+     * counting hits in a table of the requested nodes.
+     */
+    std::vector<std::size_t> score_against(NodeId const &a, std::vector<NodeId> const &others, bool co_cited) const {
+        Node *node = find_or_throw(a);
+        std::vector<Node *> targets = resolve_many(others);
+        std::unordered_map<Node const *, std::size_t> hits;
+        hits.reserve(targets.size());
+        for (Node *t : targets) {
+            if (t == nullptr) {
+                throw PublicationNotFound();
             }
-            os << std::endl;
-            os << "Parents of " << pair.first << ": ";
-            std::set<NodeId> s;
-            for (auto const &p: node->get_parent_set()) {
-                s.insert(p->get_publication().get_id());
+            hits.emplace(t, 0);
+        }
+        if (co_cited) {
+            for (auto &c : node->children) {
+                for (Node *p : c->parents) {
+                    auto hit = hits.find(p);
+                    if (hit != hits.end()) {
+                        ++hit->second;
+                    }
+                }
             }
-            for (auto const &p: s) {
-                os << p << " ";
+        } else {
+            for (Node *p : node->parents) {
+                if (p->tombstoned) {
+                    continue;
+                }
+                for (auto &c : p->children) {
+                    auto hit = hits.find(c.get());
+                    if (hit != hits.end()) {
+                        ++hit->second;
+                    }
+                }
             }
-            os << std::endl;
         }
-        os << std::endl;
-        return os;
+        std::vector<std::size_t> scores;
+        scores.reserve(targets.size());
+        for (Node *t : targets) {
+            scores.push_back(hits.find(t)->second);
+        }
+        return scores;
+    }
+
+    // Live ancestors or descendants of start, start excluded, ordered by id
+    std::vector<NodeId> closure(Node *start, bool upwards) const {
+        std::vector<Node *> found;
+        std::unordered_set<Node const *> visited{start};
+        auto visit = [&](Node *n) {
+            if (!n->is_tombstoned() && visited.insert(n).second) {
+                found.push_back(n);
+            }
+        };
+        for (std::size_t i = 0; i <= found.size(); ++i) {
+            Node *n = i == 0 ? start : found[i - 1];
+            if (upwards) {
+                for (Node *p : n->parents) {
+                    visit(p);
+                }
+            } else {
+                for (auto &c : n->children) {
+                    visit(c.get());
+                }
+            }
+        }
+        std::sort(found.begin(), found.end(), [](Node const *a, Node const *b) { return a->id < b->id; });
+        std::vector<NodeId> ids;
+        ids.reserve(found.size());
+        for (Node *n : found) {
+            ids.push_back(n->id);
+        }
+        return ids;
+    }
 
+    std::vector<NodeId> cached_closure(NodeId const &id, bool upwards) const {
+        Node *node = find_or_throw(id);
+        {
+            std::lock_guard<std::mutex> lock(query_cache->mutex);
+            query_cache->expire(version);
+            if (std::vector<NodeId> const *hit = query_cache->find(id, upwards)) {
+                return *hit;
+            }
+        }
+        std::vector<NodeId> result = closure(node, upwards);
+        std::lock_guard<std::mutex> lock(query_cache->mutex);
+        query_cache->insert(id, upwards, result);
+        return result;
     }
 
-    std::string to_string(){
-       std::ostringstream stream;
-       stream << *this;
-       return stream.str();
+    // Words of the reachability bitset block of one node, within roughly 64MB for all nodes
+    static std::size_t reach_block_words(std::size_t n) {
+        return std::max<std::size_t>(1, std::min((n + 63) / 64, (std::size_t{1} << 23) / std::max<std::size_t>(n, 1)));
     }
+
+    /**
+     * Marks the edges of t that the transitive reduction keeps. The edge u -> c is implied
+     * when c is a descendant of a child of u. Descendant bitsets are merged in reverse
+     * topological order one block of targets at a time, as in top_influential(), and every
+     * child of u is tested against the union of its siblings' sets before it is added to the
+     * set of u. Blocks are spread over the workers and own disjoint edges.
+     */
+    static std::vector<char> reduction_mask(Topology const &t, unsigned threads) {
+        std::size_t n = t.nodes.size();
+        std::vector<std::size_t> order = topological_order(t);
+        std::size_t block_words = reach_block_words(n);
+        std::size_t blocks = ((n + 63) / 64 + block_words - 1) / block_words;
+        unsigned workers = worker_count(threads, blocks);
+
+        std::vector<char> keep(t.targets.size(), 1);
+        run_workers(workers, [&](unsigned worker) {
+            std::vector<std::uint64_t> reach(n * block_words);
+            for (std::size_t block = worker; block < blocks; block += workers) {
+                std::size_t first = block * block_words * 64;
+                std::size_t end = first + block_words * 64;
+                std::fill(reach.begin(), reach.end(), 0);
+                for (auto v = order.rbegin(); v != order.rend(); ++v) {
+                    std::uint64_t *row = &reach[*v * block_words];
+                    for (std::size_t e = t.offsets[*v]; e < t.offsets[*v + 1]; ++e) {
+                        std::uint64_t const *child_row = &reach[t.targets[e] * block_words];
+                        for (std::size_t w = 0; w < block_words; ++w) {
+                            row[w] |= child_row[w];
+                        }
+                    }
+                    for (std::size_t e = t.offsets[*v]; e < t.offsets[*v + 1]; ++e) {
+                        std::size_t c = t.targets[e];
+                        if (c >= first && c < end && (row[(c - first) / 64] >> ((c - first) % 64) & 1) != 0) {
+                            keep[e] = 0;
+                        }
+                    }
+                    for (std::size_t e = t.offsets[*v]; e < t.offsets[*v + 1]; ++e) {
+                        std::size_t c = t.targets[e];
+                        if (c >= first && c < end) {
+                            row[(c - first) / 64] |= std::uint64_t{1} << ((c - first) % 64);
+                        }
+                    }
+                }
+            }
+        });
+        return keep;
+    }
+
+    // Returns start followed by all of its descendants in BFS order
+    std::vector<Node *> collect_descendants(Node *start) const {
+        std::vector<Node *> cone{start};
+        std::unordered_set<Node const *> visited{start};
+        for (std::size_t i = 0; i < cone.size(); ++i) {
+            for (auto &c : cone[i]->children) {
+                if (visited.insert(c.get()).second) {
+                    cone.push_back(c.get());
+                }
+            }
+        }
+        return cone;
+    }
+
+    /**
+     * Bulk copy of the descendant cone of start, which becomes the source of the new graph.
+     * Nodes are created in id order so that every lookup and child set insertion is a hinted
+     * append, the translation table is sized once up front.
+     */
+    CitationGraph(CitationGraph const &other, Node *start) : source_id(start->id) {
+        std::vector<Node *> cone;
+        if (start == other.source.get()) {
+            cone.reserve(other.publication_ids->size());
+            for (auto &pair : *other.publication_ids) {
+                Node *node = pair.second.lock().get();
+                if (!node->is_tombstoned()) {
+                    cone.push_back(node);
+                }
+            }
+        } else {
+            cone = other.collect_descendants(start);
+            std::sort(cone.begin(), cone.end(), [](Node const *a, Node const *b) { return *a < *b; });
+        }
+
+        std::vector<std::shared_ptr<Node>> copies;
+        copies.reserve(cone.size());
+        std::unordered_map<Node const *, std::size_t> translation;
+        translation.reserve(cone.size());
+        for (Node *node : cone) {
+            copies.push_back(std::make_shared<Node>(node->id, publication_ids.get(), publications.get()));
+            auto iter = publication_ids->emplace_hint(publication_ids->end(), node->id, copies.back());
+            copies.back()->set_lookup_iterator(iter);
+            translation.emplace(node, copies.size() - 1);
+        }
+        for (std::size_t i = 0; i < cone.size(); ++i) {
+            Node *copy = copies[i].get();
+            for (auto &c : cone[i]->children) {
+                std::shared_ptr<Node> &child = copies[translation.find(c.get())->second];
+                copy->children.emplace_hint(copy->children.end(), child);
+                child->parents.insert(copy);
+            }
+        }
+        this->source = copies[translation.find(start)->second];
+        reset_depths();
+    }
+
+    // Bulk build from a snapshot, keeping the edges selected by keep, see transitive_reduction()
+    CitationGraph(Topology const &t, std::vector<char> const &keep) : source_id(t.nodes[t.source]->id) {
+        std::vector<std::shared_ptr<Node>> copies;
+        copies.reserve(t.nodes.size());
+        for (Node *node : t.nodes) {
+            copies.push_back(std::make_shared<Node>(node->id, publication_ids.get(), publications.get()));
+            auto iter = publication_ids->emplace_hint(publication_ids->end(), node->id, copies.back());
+            copies.back()->set_lookup_iterator(iter);
+        }
+        for (std::size_t i = 0; i < t.nodes.size(); ++i) {
+            Node *copy = copies[i].get();
+            for (std::size_t e = t.offsets[i]; e < t.offsets[i + 1]; ++e) {
+                if (keep[e]) {
+                    std::shared_ptr<Node> &child = copies[t.targets[e]];
+                    copy->children.emplace_hint(copy->children.end(), child);
+                    child->parents.insert(copy);
+                }
+            }
+        }
+        this->source = copies[t.source];
+        reset_depths();
+    }
+
+public:
+
+    explicit CitationGraph(NodeId const &stem_id) : source_id(stem_id) {
+        std::shared_ptr<Node> root = std::make_shared<Node>(stem_id, publication_ids.get(), publications.get());
+        auto iter = publication_ids->insert(publication_ids->begin(), std::make_pair(stem_id, root));
+        root->set_lookup_iterator(iter);
+        this->source = root;
+    }
+
+    /**
+     * Moves are O(1): nodes refer to the heap-allocated lookup map and publication store,
+     * which change hands with them. A moved-from graph may only be destroyed or assigned to.
+     */
+    CitationGraph(CitationGraph<Publication> &&other) noexcept
+        : publication_ids(std::move(other.publication_ids)), publications(std::move(other.publications)), source(std::move(other.source)),
+          source_id(std::move(other.source_id)), removal_mode(other.removal_mode), removal_threads(other.removal_threads),
+          parallel_min_cascade(other.parallel_min_cascade),
+          graveyard(std::move(other.graveyard)), version(other.version), log(other.log),
+          observers(std::move(other.observers)), generations(std::move(other.generations)),
+          live_publications(other.live_publications), live_citations(other.live_citations),
+          query_cache(std::move(other.query_cache)), undo_log(std::move(other.undo_log)), batching(other.batching) {
+        other.log = nullptr;
+    }
+
+    // The previous contents of this graph are released together with other
+    CitationGraph<Publication> &operator=(CitationGraph<Publication> &&other) noexcept {
+        std::swap(this->publication_ids, other.publication_ids);
+        std::swap(this->publications, other.publications);
+        std::swap(this->source, other.source);
+        std::swap(this->source_id, other.source_id);
+        std::swap(this->removal_mode, other.removal_mode);
+        std::swap(this->removal_threads, other.removal_threads);
+        std::swap(this->parallel_min_cascade, other.parallel_min_cascade);
+        std::swap(this->graveyard, other.graveyard);
+        std::swap(this->version, other.version);
+        std::swap(this->query_cache, other.query_cache);
+        std::swap(this->generations, other.generations);
+        std::swap(this->live_publications, other.live_publications);
+        std::swap(this->live_citations, other.live_citations);
+        std::swap(this->log, other.log);
+        std::swap(this->observers, other.observers);
+        std::swap(this->undo_log, other.undo_log);
+        std::swap(this->batching, other.batching);
+        return *this;
+    }
+
+    // Deep graphs, and large ones in PARALLEL mode, are freed by free_nodes() as in remove()
+    ~CitationGraph() {
+        if (source == nullptr || batching) {
+            return;
+        }
+        // Tombstones keep the generations they had, which may be deeper than the histogram
+        bool deep = generations.size() > DEEP_FREE_MIN || !graveyard.empty();
+        if (!deep && (removal_mode != PARALLEL || publication_ids->size() < parallel_min_cascade)) {
+            return;
+        }
+        std::vector<std::shared_ptr<Node>> doomed;
+        try {
+            doomed.reserve(publication_ids->size() + graveyard.size());
+            doomed.push_back(std::move(source));
+            doomed.insert(doomed.end(), std::make_move_iterator(graveyard.begin()), std::make_move_iterator(graveyard.end()));
+            graveyard.clear();
+            for (auto const &n : doomed) {
+                n->in_cone = true;
+            }
+            for (std::size_t i = 0; i < doomed.size(); ++i) {
+                for (auto const &c : doomed[i]->children) {
+                    if (!c->in_cone) {
+                        c->in_cone = true;
+                        doomed.push_back(c);
+                    }
+                }
+            }
+        } catch (std::bad_alloc &) {
+            // The nodes collected so far are released one by one, the rest with their parents
+            return;
+        }
+        free_nodes(doomed, removal_mode == PARALLEL
+                           ? worker_count(removal_threads, doomed.size() / PARALLEL_FREE_PER_WORKER) : 1);
+    }
+
+    NodeId get_root_id() const {
+        return this->source_id;
+    }
+
+    std::vector<NodeId> get_children(NodeId const &id) const {
+        ChildSet &c = find_or_throw(id)->get_child_set();
+        return to_vector(c);
+    }
+
+    std::vector<NodeId> get_parents(NodeId const &id) const {
+        ParentSet &a = find_or_throw(id)->get_parent_set();
+        return to_vector_parent(a);
+    }
+
+    bool exists(NodeId const &id) const {
+        return find_live(id) != nullptr;
+    }
+
+    const Publication &operator[](NodeId const &id) const {
+        return find_or_throw(id)->get_publication();
+    }
+
+    /**
+     * Returns the ids of all publications transitively cited by id, ordered by id.
+     * Results are memoized until the next mutation of the graph.
+     */
+    std::vector<NodeId> get_ancestors(NodeId const &id) const {
+        return cached_closure(id, true);
+    }
+
+    // Ids of all publications transitively citing id, ordered by id, memoized as above
+    std::vector<NodeId> get_descendants(NodeId const &id) const {
+        return cached_closure(id, false);
+    }
+
+    /**
+     * Reusable state of bfs() and dfs(). A traversal clears it when it starts and the buffers
+     * keep their capacity, so once warmed up, traversals do not allocate. Visited nodes go to
+     * an open addressing table, with the smallest depth they were reached at, that is cleared
+     * in time proportional to what was visited.
+     */
+    class TraversalScratch {
+    private:
+        std::vector<Node const *> slots;
+        std::vector<std::size_t> depths;
+        std::vector<std::size_t> used;
+        unsigned bits = 0;
+        std::vector<std::pair<Node *, std::size_t>> pending;
+        std::size_t head = 0;
+
+        friend class CitationGraph;
+
+        std::size_t slot_of(Node const *n) const noexcept {
+            return static_cast<std::size_t>((reinterpret_cast<std::uintptr_t>(n) * 0x9E3779B97F4A7C15ull) >> (64 - bits));
+        }
+
+        void place(Node const *n, std::size_t depth, std::size_t slot) {
+            while (slots[slot] != nullptr) {
+                slot = (slot + 1) & (slots.size() - 1);
+            }
+            slots[slot] = n;
+            depths[slot] = depth;
+            used.push_back(slot);
+        }
+
+        // Returns false if n was already visited, else records it at depth
+        bool visit(Node const *n, std::size_t depth = 0) {
+            if ((used.size() + 1) * 2 > slots.size()) {
+                std::vector<Node const *> old(slots.size() * 2 + (slots.empty() ? 64 : 0), nullptr);
+                std::vector<std::size_t> old_depths(old.size());
+                old.swap(slots);
+                old_depths.swap(depths);
+                bits = 0;
+                while ((std::size_t{1} << bits) < slots.size()) {
+                    ++bits;
+                }
+                std::vector<std::size_t> old_used;
+                old_used.swap(used);
+                used.reserve(slots.size() / 2);
+                for (std::size_t slot : old_used) {
+                    place(old[slot], old_depths[slot], slot_of(old[slot]));
+                }
+            }
+            std::size_t slot = slot_of(n);
+            while (slots[slot] != nullptr) {
+                if (slots[slot] == n) {
+                    return false;
+                }
+                slot = (slot + 1) & (slots.size() - 1);
+            }
+            slots[slot] = n;
+            depths[slot] = depth;
+            used.push_back(slot);
+            return true;
+        }
+
+        // Smallest depth recorded for the visited node n
+        std::size_t &depth_of(Node const *n) noexcept {
+            std::size_t slot = slot_of(n);
+            while (slots[slot] != n) {
+                slot = (slot + 1) & (slots.size() - 1);
+            }
+            return depths[slot];
+        }
+
+        void clear() noexcept {
+            for (std::size_t slot : used) {
+                slots[slot] = nullptr;
+            }
+            used.clear();
+            pending.clear();
+            head = 0;
+        }
+    };
+
+    /**
+     * Lazy traversal over the citers of a publication, see bfs() and dfs(). The start comes
+     * first, at depth 0. The children of a publication are only looked at when the iterator
+     * moves past it, so stopping early costs nothing beyond what was visited. The graph must
+     * not be mutated while a traversal is in use.
+     */
+    class Traversal {
+    public:
+        class iterator {
+        private:
+            Traversal *traversal;
+
+        public:
+            using iterator_category = std::input_iterator_tag;
+            using value_type = NodeId;
+            using difference_type = std::ptrdiff_t;
+            using pointer = NodeId const *;
+            using reference = NodeId const &;
+
+            explicit iterator(Traversal *traversal = nullptr) noexcept : traversal(traversal) {}
+
+            reference operator*() const noexcept { return traversal->current->id; }
+
+            pointer operator->() const noexcept { return &traversal->current->id; }
+
+            // Citation distance from the start along the path that reached the current publication
+            std::size_t depth() const noexcept { return traversal->current_depth; }
+
+            iterator &operator++() {
+                traversal->advance();
+                if (traversal->current == nullptr) {
+                    traversal = nullptr;
+                }
+                return *this;
+            }
+
+            iterator operator++(int) {
+                iterator previous = *this;
+                ++*this;
+                return previous;
+            }
+
+            bool operator==(iterator const &other) const noexcept { return traversal == other.traversal; }
+
+            bool operator!=(iterator const &other) const noexcept { return traversal != other.traversal; }
+        };
+
+        iterator begin() noexcept { return iterator(current == nullptr ? nullptr : this); }
+
+        iterator end() noexcept { return iterator(); }
+
+    private:
+        std::unique_ptr<TraversalScratch> owned;
+        TraversalScratch *scratch;
+        bool breadth_first;
+        std::size_t max_depth;
+        Node *current = nullptr;
+        std::size_t current_depth = 0;
+
+        friend class CitationGraph;
+
+        Traversal(Node *start, bool breadth_first, std::size_t max_depth, TraversalScratch *external)
+            : owned(external == nullptr ? std::make_unique<TraversalScratch>() : nullptr),
+              scratch(external == nullptr ? owned.get() : external),
+              breadth_first(breadth_first), max_depth(max_depth) {
+            scratch->clear();
+            if (breadth_first) {
+                scratch->visit(start);
+            }
+            scratch->pending.emplace_back(start, 0);
+            advance();
+        }
+
+        // Reversed, so that citers are reached in id order
+        void push_children(Node *n, std::size_t depth) {
+            for (auto c = n->children.rbegin(); c != n->children.rend(); ++c) {
+                if (!(*c)->is_tombstoned()) {
+                    scratch->pending.emplace_back(c->get(), depth + 1);
+                }
+            }
+        }
+
+        /**
+         * Breadth first marks nodes when they are queued, depth first when they are reached.
+         * With a max_depth, depth first expands a node again when it is reached closer to the
+         * start than before, since citers out of range on the first path may be in range now.
+         */
+        void advance() {
+            std::vector<std::pair<Node *, std::size_t>> &pending = scratch->pending;
+            if (current != nullptr && current_depth < max_depth) {
+                if (breadth_first) {
+                    for (auto &c : current->children) {
+                        if (!c->is_tombstoned() && scratch->visit(c.get())) {
+                            pending.emplace_back(c.get(), current_depth + 1);
+                        }
+                    }
+                } else {
+                    push_children(current, current_depth);
+                }
+            }
+            current = nullptr;
+            if (breadth_first) {
+                if (scratch->head < pending.size()) {
+                    std::tie(current, current_depth) = pending[scratch->head++];
+                }
+                return;
+            }
+            while (!pending.empty()) {
+                std::pair<Node *, std::size_t> next = pending.back();
+                pending.pop_back();
+                if (scratch->visit(next.first, next.second)) {
+                    std::tie(current, current_depth) = next;
+                    return;
+                }
+                if (max_depth != SIZE_MAX) {
+                    std::size_t &depth = scratch->depth_of(next.first);
+                    if (next.second < depth) {
+                        depth = next.second;
+                        if (depth < max_depth) {
+                            push_children(next.first, depth);
+                        }
+                    }
+                }
+            }
+        }
+    };
+
+    /**
+     * Breadth first traversal of id and the publications citing it, transitively, up to
+     * max_depth citations away. Pass a scratch to reuse its buffers across traversals.
+     */
+    Traversal bfs(NodeId const &id, std::size_t max_depth = SIZE_MAX, TraversalScratch *scratch = nullptr) const {
+        return Traversal(find_or_throw(id), true, max_depth, scratch);
+    }
+
+    // Depth first (preorder) variant of bfs(), citers are entered in id order
+    Traversal dfs(NodeId const &id, std::size_t max_depth = SIZE_MAX, TraversalScratch *scratch = nullptr) const {
+        return Traversal(find_or_throw(id), false, max_depth, scratch);
+    }
+
+    // Batched exists(), element i answers for ids[i]
+    std::vector<bool> exists_many(std::vector<NodeId> const &ids) const {
+        std::vector<Node *> nodes = resolve_many(ids);
+        std::vector<bool> result(nodes.size());
+        for (std::size_t i = 0; i < nodes.size(); ++i) {
+            result[i] = nodes[i] != nullptr;
+        }
+        return result;
+    }
+
+    // Batched get_children(), element i holds the children of ids[i], or nothing if it does not exist
+    std::vector<std::optional<std::vector<NodeId>>> children_many(std::vector<NodeId> const &ids) const {
+        return neighbours_many(ids, true);
+    }
+
+    // Batched get_parents(), as children_many()
+    std::vector<std::optional<std::vector<NodeId>>> parents_many(std::vector<NodeId> const &ids) const {
+        return neighbours_many(ids, false);
+    }
+
+    /**
+     * Batched operator[], element i refers to the publication of ids[i]. Throws
+     * PublicationNotFound if any of the ids does not exist.
+     */
+    std::vector<std::reference_wrapper<const Publication>> lookup_many(std::vector<NodeId> const &ids) const {
+        std::vector<Node *> nodes = resolve_many(ids);
+        std::vector<std::reference_wrapper<const Publication>> result;
+        result.reserve(nodes.size());
+        for (Node *node : nodes) {
+            if (node == nullptr) {
+                throw PublicationNotFound();
+            }
+            result.emplace_back(node->get_publication());
+        }
+        return result;
+    }
+
+    // Co-citation: the number of publications citing both a and b
+    std::size_t co_citation(NodeId const &a, NodeId const &b) const {
+        return shared_citers(find_or_throw(a), find_or_throw(b));
+    }
+
+    // Bibliographic coupling: the number of publications cited by both a and b
+    std::size_t coupling(NodeId const &a, NodeId const &b) const {
+        return shared_references(find_or_throw(a), find_or_throw(b));
+    }
+
+    // Element i is co_citation(a, others[i])
+    std::vector<std::size_t> co_citation(NodeId const &a, std::vector<NodeId> const &others) const {
+        return score_against(a, others, true);
+    }
+
+    // Element i is coupling(a, others[i])
+    std::vector<std::size_t> coupling(NodeId const &a, std::vector<NodeId> const &others) const {
+        return score_against(a, others, false);
+    }
+
+    /**
+     * Checks whether child_id cites parent_id directly. Unknown ids yield false rather than
+     * an exception, so the check never allocates.
+     */
+    bool has_citation(NodeId const &child_id, NodeId const &parent_id) const noexcept(noexcept(child_id < parent_id)) {
+        Node *child = find_live(child_id);
+        Node *parent = child == nullptr ? nullptr : find_live(parent_id);
+        return parent != nullptr && child->parents.count(parent) != 0;
+    }
+
+    // Generation of id: the length of the longest citation path from the source
+    std::size_t depth(NodeId const &id) const {
+        return find_or_throw(id)->longest;
+    }
+
+    // Length of the shortest citation path from the source to id
+    std::size_t min_depth(NodeId const &id) const {
+        return find_or_throw(id)->shortest;
+    }
+
+    // Element i is the number of publications of generation i, see depth()
+    std::vector<std::size_t> const &generation_histogram() const noexcept {
+        return generations;
+    }
+
+    // O(1), unlike stats()
+    Counters counters() const noexcept {
+        return {live_publications, live_citations};
+    }
+
+    /**
+     * Degree and depth distributions of the live graph in one pass over its nodes, which are
+     * split between up to threads workers, 0 meaning one per hardware thread. Adjacency is
+     * read in place, each worker keeps its own histograms and its k best hubs.
+     */
+    GraphStats stats(std::size_t hubs = 10, unsigned threads = 0) const {
+        std::vector<Node *> nodes;
+        nodes.reserve(live_publications);
+        for (auto &pair : *publication_ids) {
+            Node *node = pair.second.lock().get();
+            if (!node->is_tombstoned()) {
+                nodes.push_back(node);
+            }
+        }
+
+        struct Partial {
+            std::size_t citations = 0;
+            std::size_t children = 0;
+            std::vector<std::size_t> in_degrees, out_degrees, depths, min_depths;
+            // Heap with the weakest of the best hubs on top
+            std::vector<Node *> hubs;
+            std::vector<Node *> orphans;
+        };
+        auto count = [](std::vector<std::size_t> &histogram, std::size_t i) {
+            if (i >= histogram.size()) {
+                histogram.resize(i + 1);
+            }
+            ++histogram[i];
+        };
+        auto merge = [](std::vector<std::size_t> &into, std::vector<std::size_t> const &from) {
+            if (from.size() > into.size()) {
+                into.resize(from.size());
+            }
+            for (std::size_t i = 0; i < from.size(); ++i) {
+                into[i] += from[i];
+            }
+        };
+        auto stronger = [](Node const *a, Node const *b) {
+            return a->children.size() != b->children.size() ? a->children.size() > b->children.size() : a->id < b->id;
+        };
+
+        unsigned workers = worker_count(threads, nodes.size() / STATS_PER_WORKER);
+        std::vector<Partial> partials(workers);
+        run_workers(workers, [&](unsigned worker) {
+            Partial &part = partials[worker];
+            part.hubs.reserve(std::min(hubs, nodes.size()) + 1);
+            std::size_t end = nodes.size() * (worker + 1) / workers;
+            for (std::size_t i = nodes.size() * worker / workers; i < end; ++i) {
+                Node *n = nodes[i];
+                std::size_t parents = 0;
+                for (Node *p : n->parents) {
+                    parents += !p->tombstoned;
+                }
+                part.citations += parents;
+                part.children += n->children.size();
+                count(part.in_degrees, parents);
+                count(part.out_degrees, n->children.size());
+                count(part.depths, n->longest);
+                count(part.min_depths, n->shortest);
+                if (parents == 0 && n != source.get()) {
+                    part.orphans.push_back(n);
+                }
+                if (part.hubs.size() < hubs || (hubs > 0 && stronger(n, part.hubs.front()))) {
+                    part.hubs.push_back(n);
+                    std::push_heap(part.hubs.begin(), part.hubs.end(), stronger);
+                    if (part.hubs.size() > hubs) {
+                        std::pop_heap(part.hubs.begin(), part.hubs.end(), stronger);
+                        part.hubs.pop_back();
+                    }
+                }
+            }
+        });
+
+        GraphStats result;
+        result.publications = nodes.size();
+        std::size_t children = 0;
+        std::vector<Node *> best, orphans;
+        for (Partial &part : partials) {
+            result.citations += part.citations;
+            children += part.children;
+            merge(result.in_degrees, part.in_degrees);
+            merge(result.out_degrees, part.out_degrees);
+            merge(result.depths, part.depths);
+            merge(result.min_depths, part.min_depths);
+            best.insert(best.end(), part.hubs.begin(), part.hubs.end());
+            orphans.insert(orphans.end(), part.orphans.begin(), part.orphans.end());
+        }
+        std::size_t k = std::min(hubs, best.size());
+        std::partial_sort(best.begin(), best.begin() + k, best.end(), stronger);
+        for (std::size_t i = 0; i < k; ++i) {
+            result.hubs.emplace_back(best[i]->id, best[i]->children.size());
+        }
+        // Workers took the nodes in id order
+        for (Node *n : orphans) {
+            result.orphans.push_back(n->id);
+        }
+
+        std::vector<std::size_t> histogram = generations;
+        while (histogram.size() > 1 && histogram.back() == 0) {
+            histogram.pop_back();
+        }
+        result.consistent = result.orphans.empty() && children == result.citations
+                            && result.publications == live_publications && result.citations == live_citations
+                            && result.depths == histogram;
+        return result;
+    }
+
+    // Incremented by every create, add_citation and remove that changed the graph
+    std::uint64_t get_version() const noexcept {
+        return version;
+    }
+
+    /**
+     * Independent copy of the whole graph. Publications are constructed anew from their ids,
+     * as in create().
+     */
+    CitationGraph clone() const {
+        return CitationGraph(*this, source.get());
+    }
+
+    // Independent graph holding root_id and everything that transitively cites it
+    CitationGraph extract_subgraph(NodeId const &root_id) const {
+        return CitationGraph(*this, find_or_throw(root_id));
+    }
+
+    /**
+     * Citations, as (child, parent) pairs, implied by a longer citation path: the publications
+     * reachable from any publication stay the same without them. Runs on threads workers,
+     * 0 means one per hardware thread.
+     */
+    std::vector<std::pair<NodeId, NodeId>> redundant_citations(unsigned threads = 0) const {
+        Topology t = snapshot_topology();
+        std::vector<char> keep = reduction_mask(t, threads);
+        std::vector<std::pair<NodeId, NodeId>> redundant;
+        for (std::size_t i = 0; i < t.nodes.size(); ++i) {
+            for (std::size_t e = t.offsets[i]; e < t.offsets[i + 1]; ++e) {
+                if (!keep[e]) {
+                    redundant.emplace_back(t.nodes[t.targets[e]]->id, t.nodes[i]->id);
+                }
+            }
+        }
+        return redundant;
+    }
+
+    /**
+     * Independent copy of the graph without its redundant citations, the smallest graph with
+     * the same reachability. The number of dropped citations is stored in dropped if given.
+     */
+    CitationGraph transitive_reduction(std::size_t *dropped = nullptr, unsigned threads = 0) const {
+        Topology t = snapshot_topology();
+        std::vector<char> keep = reduction_mask(t, threads);
+        if (dropped != nullptr) {
+            *dropped = static_cast<std::size_t>(std::count(keep.begin(), keep.end(), 0));
+        }
+        return CitationGraph(t, keep);
+    }
+
+    /**
+     * Calls visit(id, parent_ids) for every publication but the root, each after its parents.
+     * Reads the nodes directly, unlike get_descendants() it leaves the query cache alone.
+     */
+    template<typename Visit>
+    void visit_topological(Visit visit) const {
+        Topology t = snapshot_topology();
+        std::vector<std::size_t> order = topological_order(t);
+        std::vector<NodeId> parent_ids;
+        for (std::size_t i = 1; i < order.size(); ++i) {
+            Node const *node = t.nodes[order[i]];
+            parent_ids.clear();
+            for (Node const *p : node->parents) {
+                parent_ids.push_back(p->id);
+            }
+            visit(node->id, parent_ids);
+        }
+    }
+
+    /**
+     * Immutable copy of the graph in compact arrays, for readers that never mutate it.
+     * Publications are constructed anew from their ids, as in clone().
+     */
+    FrozenCitationGraph<Publication> freeze() const {
+        Topology t = snapshot_topology();
+        std::vector<NodeId> ids;
+        ids.reserve(t.nodes.size());
+        for (Node *node : t.nodes) {
+            ids.push_back(node->id);
+        }
+        return FrozenCitationGraph<Publication>(std::move(ids), t.offsets, t.targets, t.source);
+    }
+
+    /**
+     * Returns the k publications, the source excluded, with the most transitive citers,
+     * together with their exact citer counts, largest first.
+     * Descendant sets are propagated as bitsets in reverse topological order. The nodes are
+     * split into blocks of columns that are processed independently by up to threads
+     * workers, 0 meaning one per hardware thread. Time is O(V * E / 64).
+     */
+    std::vector<std::pair<NodeId, std::size_t>> top_influential(std::size_t k, unsigned threads = 0) const {
+        Topology t = snapshot_topology();
+        std::vector<std::size_t> order = topological_order(t);
+        std::size_t n = t.nodes.size();
+
+        // One block of words per node and worker
+        std::size_t total_words = (n + 63) / 64;
+        std::size_t block_words = reach_block_words(n);
+        std::size_t blocks = (total_words + block_words - 1) / block_words;
+        unsigned workers = worker_count(threads, blocks);
+
+        std::vector<std::vector<std::size_t>> counts(workers, std::vector<std::size_t>(n, 0));
+        std::vector<std::vector<std::uint64_t>> bits(workers, std::vector<std::uint64_t>(n * block_words));
+        run_workers(workers, [&](unsigned worker) {
+            std::vector<std::uint64_t> &reach = bits[worker];
+            std::vector<std::size_t> &count = counts[worker];
+            for (std::size_t block = worker; block < blocks; block += workers) {
+                std::size_t first = block * block_words * 64;
+                std::fill(reach.begin(), reach.end(), 0);
+                for (auto v = order.rbegin(); v != order.rend(); ++v) {
+                    std::uint64_t *row = &reach[*v * block_words];
+                    for (std::size_t e = t.offsets[*v]; e < t.offsets[*v + 1]; ++e) {
+                        std::size_t c = t.targets[e];
+                        std::uint64_t const *child_row = &reach[c * block_words];
+                        for (std::size_t w = 0; w < block_words; ++w) {
+                            row[w] |= child_row[w];
+                        }
+                        if (c >= first && c < first + block_words * 64) {
+                            row[(c - first) / 64] |= std::uint64_t{1} << ((c - first) % 64);
+                        }
+                    }
+                    std::size_t reached = 0;
+                    for (std::size_t w = 0; w < block_words; ++w) {
+                        reached += __builtin_popcountll(row[w]);
+                    }
+                    count[*v] += reached;
+                }
+            }
+        });
+        for (unsigned w = 1; w < workers; ++w) {
+            for (std::size_t v = 0; v < n; ++v) {
+                counts[0][v] += counts[w][v];
+            }
+        }
+        return top_by_score(t, counts[0], k);
+    }
+
+    /**
+     * Approximate variant of top_influential for graphs too large for exact counting.
+     * Every node carries a HyperLogLog sketch of its citers, merged in reverse topological
+     * order, with enough registers for the requested relative standard error (clamped to
+     * 2^4 .. 2^16 registers). The registers are split between the workers.
+     * Memory is one byte per register per node, which for 10M publications at 1% error is
+     * 160GB. Throws std::length_error if the sketches for relative_error need more than
+     * max_bytes, instead of trading precision for memory behind the caller's back.
+     */
+    std::vector<std::pair<NodeId, std::size_t>>
+    top_influential_estimate(std::size_t k, double relative_error, unsigned threads = 0,
+                             std::size_t max_bytes = std::size_t{1} << 30) const {
+        Topology t = snapshot_topology();
+        std::vector<std::size_t> order = topological_order(t);
+        std::size_t n = t.nodes.size();
+
+        unsigned precision = 4;
+        while (precision < 16 && 1.04 / std::sqrt(double(std::size_t{1} << precision)) > relative_error) {
+            ++precision;
+        }
+        if (n > max_bytes >> precision) {
+            throw std::length_error("CitationGraph influence sketches exceed max_bytes");
+        }
+        std::size_t m = std::size_t{1} << precision;
+        std::vector<std::uint8_t> registers(n * m, 0);
+        // Register and rank that node v contributes to the sketches of its ancestors
+        std::vector<std::uint32_t> slot(n);
+        std::vector<std::uint8_t> rank(n);
+        for (std::size_t v = 0; v < n; ++v) {
+            std::uint64_t h = v + 0x9e3779b97f4a7c15ULL;
+            h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+            h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+            h ^= h >> 31;
+            slot[v] = static_cast<std::uint32_t>(h >> (64 - precision));
+            std::uint64_t rest = (h << precision) | (std::uint64_t{1} << (precision - 1));
+            rank[v] = static_cast<std::uint8_t>(__builtin_clzll(rest) + 1);
+        }
+
+        unsigned workers = worker_count(threads, m / 16);
+        run_workers(workers, [&](unsigned worker) {
+            std::size_t lo = m * worker / workers;
+            std::size_t hi = m * (worker + 1) / workers;
+            for (auto v = order.rbegin(); v != order.rend(); ++v) {
+                std::uint8_t *row = &registers[*v * m];
+                for (std::size_t e = t.offsets[*v]; e < t.offsets[*v + 1]; ++e) {
+                    std::size_t c = t.targets[e];
+                    std::uint8_t const *child_row = &registers[c * m];
+                    for (std::size_t j = lo; j < hi; ++j) {
+                        row[j] = std::max(row[j], child_row[j]);
+                    }
+                    if (slot[c] >= lo && slot[c] < hi) {
+                        row[slot[c]] = std::max(row[slot[c]], rank[c]);
+                    }
+                }
+            }
+        });
+
+        std::vector<std::size_t> estimates(n);
+        double alpha = m == 16 ? 0.673 : m == 32 ? 0.697 : m == 64 ? 0.709 : 0.7213 / (1.0 + 1.079 / m);
+        for (std::size_t v = 0; v < n; ++v) {
+            double sum = 0;
+            std::size_t zeros = 0;
+            for (std::size_t j = 0; j < m; ++j) {
+                std::uint8_t r = registers[v * m + j];
+                sum += std::ldexp(1.0, -r);
+                zeros += r == 0;
+            }
+            double estimate = alpha * m * m / sum;
+            if (estimate <= 2.5 * m && zeros > 0) {
+                estimate = m * std::log(double(m) / zeros);
+            }
+            estimates[v] = static_cast<std::size_t>(std::llround(estimate));
+        }
+        return top_by_score(t, estimates, k);
+    }
+
+    // Scores of every live publication, ordered by id, see influence_scores()
+    struct InfluenceScores {
+        std::vector<NodeId> ids;
+        std::vector<double> scores;
+        std::size_t iterations = 0;
+
+        double operator[](NodeId const &id) const {
+            auto iter = std::lower_bound(ids.begin(), ids.end(), id);
+            if (iter == ids.end() || id < *iter) {
+                throw PublicationNotFound();
+            }
+            return scores[iter - ids.begin()];
+        }
+    };
+
+    /**
+     * PageRank over the citations: every publication passes damping times its score, split
+     * evenly, to the publications it cites, publications citing nothing spread theirs over
+     * the whole graph. Scores sum to 1. Iterates until the L1 change of the scores drops below
+     * tolerance, at most max_iterations times.
+     *
+     * Runs over a CSR snapshot, each worker pulls the scores of a contiguous range of nodes
+     * from their citers, so no two workers write to the same element.
+     */
+    InfluenceScores influence_scores(double damping = 0.85, double tolerance = 1e-9,
+                                     std::size_t max_iterations = 100, unsigned threads = 0) const {
+        Topology t = snapshot_topology();
+        std::size_t n = t.nodes.size();
+        std::vector<double> share(n, 0);
+        for (std::size_t target : t.targets) {
+            share[target] += 1;
+        }
+        for (double &s : share) {
+            s = s == 0 ? 0 : 1 / s;
+        }
+
+        InfluenceScores result;
+        std::vector<double> &score = result.scores;
+        score.assign(n, 1.0 / n);
+        std::vector<double> next(n);
+        std::vector<double> contribution(n);
+        unsigned workers = worker_count(threads, n / 4096 + 1);
+        std::vector<double> dangling(workers);
+        std::vector<double> change(workers);
+        auto range = [&](unsigned worker) {
+            return std::make_pair(n * worker / workers, n * (worker + 1) / workers);
+        };
+
+        while (result.iterations < max_iterations) {
+            ++result.iterations;
+            run_workers(workers, [&](unsigned worker) {
+                double lost = 0;
+                for (std::size_t v = range(worker).first; v < range(worker).second; ++v) {
+                    contribution[v] = score[v] * share[v];
+                    lost += share[v] == 0 ? score[v] : 0;
+                }
+                dangling[worker] = lost;
+            });
+            double base = (1 - damping) / n;
+            for (double lost : dangling) {
+                base += damping * lost / n;
+            }
+            run_workers(workers, [&](unsigned worker) {
+                double total_change = 0;
+                for (std::size_t v = range(worker).first; v < range(worker).second; ++v) {
+                    // Independent partial sums, so that the gathers can overlap
+                    double sum[4] = {0, 0, 0, 0};
+                    std::size_t e = t.offsets[v];
+                    std::size_t end = t.offsets[v + 1];
+                    for (; e + 4 <= end; e += 4) {
+                        sum[0] += contribution[t.targets[e]];
+                        sum[1] += contribution[t.targets[e + 1]];
+                        sum[2] += contribution[t.targets[e + 2]];
+                        sum[3] += contribution[t.targets[e + 3]];
+                    }
+                    for (; e < end; ++e) {
+                        sum[0] += contribution[t.targets[e]];
+                    }
+                    next[v] = base + damping * ((sum[0] + sum[1]) + (sum[2] + sum[3]));
+                    total_change += std::fabs(next[v] - score[v]);
+                }
+                change[worker] = total_change;
+            });
+            score.swap(next);
+            double total_change = 0;
+            for (double c : change) {
+                total_change += c;
+            }
+            if (total_change < tolerance) {
+                break;
+            }
+        }
+
+        result.ids.reserve(n);
+        for (Node *node : t.nodes) {
+            result.ids.push_back(node->id);
+        }
+        return result;
+    }
+
+    /**
+     * Attaches a log that sees every committed create, add_citation and remove, nullptr
+     * detaches it. The graph does not take ownership.
+     */
+    void set_log(CitationLog<NodeId> *log) noexcept {
+        this->log = log;
+    }
+
+    CitationLog<NodeId> *get_log() const noexcept {
+        return this->log;
+    }
+
+    /**
+     * Registers a change feed subscriber, see CitationObserver. Events are delivered after the
+     * mutation has committed. The graph does not take ownership.
+     */
+    void subscribe(CitationObserver<NodeId> *observer) {
+        observers.push_back(observer);
+    }
+
+    void unsubscribe(CitationObserver<NodeId> *observer) noexcept {
+        observers.erase(std::remove(observers.begin(), observers.end(), observer), observers.end());
+    }
+
+    /**
+     * In DEFERRED mode remove() only detaches the publication and tombstones the nodes that
+     * lost their last live parent. Tombstoned nodes are invisible to every query, their
+     * memory is freed by reclaim().
+     * PARALLEL mode is IMMEDIATE, except that cascades of at least min_cascade publications
+     * are freed by up to threads workers, one per core for 0.
+     */
+    void set_removal_mode(RemovalMode mode, unsigned threads = 0, std::size_t min_cascade = PARALLEL_FREE_MIN) noexcept {
+        this->removal_mode = mode;
+        this->removal_threads = threads;
+        this->parallel_min_cascade = std::max<std::size_t>(min_cascade, 1);
+    }
+
+    /**
+     * Bounds the ids that memoized get_ancestors() and get_descendants() results hold, each
+     * result counting one more. Results that do not fit are computed but not kept.
+     */
+    void set_query_cache_limit(std::size_t ids) {
+        std::lock_guard<std::mutex> lock(query_cache->mutex);
+        query_cache->max_ids = ids;
+        query_cache->shrink(ids);
+    }
+
+    // Number of ids held by memoized results, each counting one more, see set_query_cache_limit()
+    std::size_t query_cache_size() const {
+        std::lock_guard<std::mutex> lock(query_cache->mutex);
+        return query_cache->cached_ids;
+    }
+
+    RemovalMode get_removal_mode() const noexcept {
+        return this->removal_mode;
+    }
+
+    std::size_t pending_reclamation() const noexcept {
+        return graveyard.size();
+    }
+
+    /**
+     * Frees at most budget tombstoned nodes, one node and its outgoing edges at a time.
+     * Returns the number of nodes processed, 0 once nothing is left to reclaim. Does nothing
+     * while a batch is open, as its undo log may refer to tombstones, see begin_batch().
+     */
+    std::size_t reclaim(std::size_t budget = SIZE_MAX) {
+        TraceScope trace(TraceRecord::RECLAIM);
+        std::size_t processed = 0;
+        while (processed < budget && !graveyard.empty() && !batching) {
+            Node *node = graveyard.back().get();
+            reserve_more(graveyard, node->children.size());
+            std::shared_ptr<Node> last = std::move(graveyard.back());
+            graveyard.pop_back();
+            for (auto &c : node->children) {
+                if (c->tombstoned && !c->queued) {
+                    c->queued = true;
+                    graveyard.push_back(c);
+                }
+            }
+            last.reset();
+            ++processed;
+        }
+        trace.finish(OK, processed);
+        return processed;
+    }
+
+    /**
+     * All-or-nothing group of mutations, see begin_batch(). Destroying a batch that was not
+     * committed rolls all of its mutations back. If that fails, as comparisons of ids throw,
+     * the mutations that could not be undone are committed instead, without the log if it
+     * fails as well: a destructor has no one to report to.
+     */
+    class Batch {
+    public:
+        Batch(Batch const &) = delete;
+
+        Batch &operator=(Batch const &) = delete;
+
+        ~Batch() {
+            if (graph != nullptr) {
+                try {
+                    graph->rollback_to(0);
+                } catch (...) {
+                    try {
+                        graph->commit_batch();
+                    } catch (...) {
+                        graph->undo_log.clear();
+                    }
+                }
+                graph->batching = false;
+            }
+        }
+
+        // Marks the current state of the batch, see rollback_to()
+        std::size_t savepoint() const {
+            return open().undo_log.size();
+        }
+
+        /**
+         * Undoes the mutations made since savepoint, savepoints taken after it become invalid.
+         * If comparing ids throws, the mutations undone so far stay undone and the call can be
+         * repeated.
+         */
+        void rollback_to(std::size_t savepoint) {
+            open().rollback_to(savepoint);
+        }
+
+        // Strong guarantee: if the log fails, the batch stays open with all of its mutations
+        void commit() {
+            open().commit_batch();
+            graph = nullptr;
+        }
+
+    private:
+        CitationGraph *graph;
+
+        // Every call but the destructor throws std::logic_error once the batch is committed
+        CitationGraph &open() const {
+            if (graph == nullptr) {
+                throw std::logic_error("CitationGraph batch already committed");
+            }
+            return *graph;
+        }
+
+        explicit Batch(CitationGraph *graph) noexcept : graph(graph) {}
+
+        friend class CitationGraph;
+    };
+
+    /**
+     * Opens a batch: the following mutations are applied as usual, visible to readers of this
+     * graph, and recorded in an undo log instead of being logged and published one by one.
+     * On commit the log gets them as one bracketed group and observers as one feed batch.
+     * Only one batch can be open at a time, and the graph must not be moved while it is.
+     */
+    Batch begin_batch() {
+        if (batching) {
+            throw std::logic_error("CitationGraph batch already open");
+        }
+        batching = true;
+        return Batch(this);
+    }
+
+    void create(NodeId const &id, NodeId const &parent_id) {
+        throw_on_error(try_create(id, parent_id));
+    }
+
+    void create(NodeId const &id, std::vector<NodeId> const &parent_ids) {
+        throw_on_error(try_create(id, parent_ids));
+    }
+
+    Status try_create(NodeId const &id, NodeId const &parent_id) {
+        TraceScope trace(TraceRecord::CREATE, id, &parent_id);
+        return trace.finish(create_node(id, &parent_id, &parent_id + 1, nullptr), 1);
+    }
+
+    /**
+     * create() reporting duplicates and missing parents by its result. Everything is validated
+     * before the graph is touched, exceptions are left to genuine failures, which still roll
+     * the graph back.
+     */
+    Status try_create(NodeId const &id, std::vector<NodeId> const &parent_ids) {
+        TraceScope trace(TraceRecord::CREATE, id, parent_ids.empty() ? nullptr : &parent_ids.front());
+        Status status = create_node(id, parent_ids.data(), parent_ids.data() + parent_ids.size(), &parent_ids);
+        return trace.finish(status, parent_ids.size());
+    }
+
+private:
+    /**
+     * Shared by both create() overloads, parent ids are read in place. listed is parent_ids
+     * as a vector if the caller has one, a single parent is only copied into a vector when
+     * the log or the undo log needs it.
+     */
+    Status create_node(NodeId const &id, NodeId const *parent_ids, NodeId const *parent_ids_end,
+                       std::vector<NodeId> const *listed) {
+        // Also the insertion hint for a new id, which spares a second search of the map
+        auto hint = publication_ids->lower_bound(id);
+        auto existing = hint != publication_ids->end() && !(id < hint->first) ? hint : publication_ids->end();
+        std::shared_ptr<Node> old;
+        if (existing != publication_ids->end()) {
+            old = existing->second.lock();
+            if (old != nullptr && !old->is_tombstoned()) {
+                return ALREADY_CREATED;
+            }
+        }
+        std::size_t parent_count = parent_ids_end - parent_ids;
+        if (parent_count == 0) {
+            return NOT_FOUND;
+        }
+        std::vector<Node *> parents;
+        parents.reserve(parent_count);
+        for (NodeId const *parent_id_iter = parent_ids; parent_id_iter != parent_ids_end; ++parent_id_iter) {
+            NodeId const &parent_id = *parent_id_iter;
+            Node *parent = parent_id == id ? nullptr : find_live(parent_id);
+            if (parent == nullptr) {
+                return NOT_FOUND;
+            }
+            parents.push_back(parent);
+        }
+
+        if (batching) {
+            reserve_more(undo_log, 1);
+        }
+
+        // Declared first so that it outlives the rollback of the transactions below
+        std::shared_ptr<Node> child = std::make_shared<Node>(id, publication_ids.get(), publications.get());
+
+        Transaction<ChildSet> c_trans;
+        Transaction<ParentSet> p_trans;
+        Transaction<NodeLookupMap> nl_trans;
+
+        // No rehash below, which keeps the iterators recorded by p_trans valid
+        child->get_parent_set().reserve(parent_count);
+        // The entry of a tombstone with the same id is taken over on commit
+        auto lookup_iterator = existing;
+        if (existing == publication_ids->end()) {
+            lookup_iterator = publication_ids->emplace_hint(hint, id, child);
+            nl_trans.record_addition(*publication_ids, lookup_iterator);
+        }
+        for (Node *parent : parents) {
+            auto c_inserted = parent->get_child_set().insert(child);
+            if (c_inserted.second) {
+                c_trans.record_addition(parent->get_child_set(), c_inserted.first);
+            }
+            auto p_inserted = child->get_parent_set().insert(parent);
+            if (p_inserted.second) {
+                p_trans.record_addition(child->get_parent_set(), p_inserted.first);
+            }
+        }
+
+        reserve_more(generations, 1);
+        std::vector<CitationEvent<NodeId>> events;
+        UndoRecord record;
+        record.type = UndoRecord::CREATED;
+        if (batching) {
+            // Only a log or observers need them, see commit_batch()
+            if (log != nullptr || !observers.empty()) {
+                std::vector<NodeId>(parent_ids, parent_ids_end).swap(record.parent_ids);
+            }
+            record.evicted = old;
+        } else {
+            if (!observers.empty()) {
+                events.reserve(child->parents.size() + 1);
+                events.push_back({CitationEvent<NodeId>::NODE_CREATED, id, id});
+                for (Node *parent : child->parents) {
+                    events.push_back({CitationEvent<NodeId>::EDGE_ADDED, id, parent->id});
+                }
+            }
+            if (log != nullptr && listed != nullptr) {
+                log->log_create(id, *listed);
+            } else if (log != nullptr) {
+                log->log_create(id, std::vector<NodeId>(parent_ids, parent_ids_end));
+            }
+        }
+
+        if (old != nullptr) {
+            old->in_lookup = false;
+        }
+        lookup_iterator->second = child;
+        child->set_lookup_iterator(lookup_iterator);
+        nl_trans.commit();
+        p_trans.commit();
+        c_trans.commit();
+        std::tie(child->longest, child->shortest) = depths_from_parents(child.get());
+        if (child->longest >= generations.size()) {
+            generations.resize(child->longest + 1);
+        }
+        ++generations[child->longest];
+        ++live_publications;
+        live_citations += child->parents.size();
+        ++version;
+        if (batching) {
+            record.node = std::move(child);
+            undo_log.push_back(std::move(record));
+        }
+        publish(events);
+        return OK;
+    }
+
+public:
+    void add_citation(NodeId const &child_id, NodeId const &parent_id) {
+        throw_on_error(try_add_citation(child_id, parent_id));
+    }
+
+    // add_citation() reporting missing publications by its result, see try_create()
+    Status try_add_citation(NodeId const &child_id, NodeId const &parent_id) {
+        TraceScope trace(TraceRecord::ADD_CITATION, child_id, &parent_id);
+        return trace.finish(cite(child_id, parent_id), 1);
+    }
+
+    void remove(NodeId const &base_remove_id) {
+        throw_on_error(try_remove(base_remove_id));
+    }
+
+    // remove() reporting a missing publication or the root by its result, see try_create()
+    Status try_remove(NodeId const &base_remove_id) {
+        // Also times the destruction of the cone in IMMEDIATE mode
+        TraceScope trace(TraceRecord::REMOVE, base_remove_id);
+        std::size_t cone_size = 0;
+        Status status = remove_cone(base_remove_id, cone_size);
+        return trace.finish(status, cone_size);
+    }
+
+private:
+    Status cite(NodeId const &child_id, NodeId const &parent_id) {
+        Node *child = find_live(child_id);
+        Node *parent = find_live(parent_id);
+        if (child == nullptr || parent == nullptr || child_id == parent_id) {
+            return NOT_FOUND;
+        }
+        if (child->parents.count(parent) != 0) {
+            return OK;
+        }
+
+        // The new edge can deepen every generation below child by at most this much
+        if (parent->longest + 1 > child->longest) {
+            reserve_more(generations, parent->longest + 1 - child->longest);
+        }
+
+        Transaction<ChildSet> c_trans;
+        Transaction<ParentSet> p_trans;
+
+        if (batching) {
+            reserve_more(undo_log, 1);
+        }
+
+        // Live nodes are always in the lookup map, no need to search it again
+        std::shared_ptr<Node> child_ptr = child->iter->second.lock();
+        p_trans.record_addition(child->get_parent_set(), child->get_parent_set().insert(parent).first);
+        c_trans.record_addition(parent->get_child_set(), parent->get_child_set().insert(child_ptr).first);
+        std::vector<CitationEvent<NodeId>> events;
+        if (!batching) {
+            if (!observers.empty()) {
+                events.push_back({CitationEvent<NodeId>::EDGE_ADDED, child_id, parent_id});
+            }
+            if (log != nullptr) {
+                log->log_citation(child_id, parent_id);
+            }
+        }
+
+        c_trans.commit();
+        p_trans.commit();
+        DepthWorklist work;
+        work.push(child);
+        settle_depths(work);
+        ++live_citations;
+        ++version;
+        if (batching) {
+            UndoRecord record;
+            record.type = UndoRecord::CITED;
+            record.node = std::move(child_ptr);
+            record.parent = parent;
+            undo_log.push_back(std::move(record));
+        }
+        publish(events);
+        return OK;
+    }
+
+    // Body of try_remove(), cone_size is set to the number of publications removed
+    Status remove_cone(NodeId const &base_remove_id, std::size_t &cone_size) {
+        auto map_iter = publication_ids->find(base_remove_id);
+        if (map_iter == publication_ids->end()) {
+            return NOT_FOUND;
+        }
+        auto node = (*map_iter).second.lock();
+        if (node == nullptr || node->is_tombstoned()) {
+            return NOT_FOUND;
+        }
+        if (base_remove_id == source_id) {
+            return ROOT_REMOVAL;
+        }
+        if (removal_mode == DEFERRED && !batching) {
+            reserve_more(graveyard, 1);
+        }
+
+        // The cone keeps its in_cone flags until it is tombstoned, or until an exception
+        Node *cone = collect_cone(node.get());
+        struct ConeGuard {
+            Node *cone;
+
+            ~ConeGuard() {
+                for (Node *n = cone; n != nullptr; n = n->next_in_cone) {
+                    n->in_cone = false;
+                }
+            }
+        } guard{cone};
+
+        std::vector<CitationEvent<NodeId>> events;
+        if (!observers.empty() && !batching) {
+            for (Node *n = cone; n != nullptr; n = n->next_in_cone) {
+                events.push_back({CitationEvent<NodeId>::NODE_REMOVED, n->id, n->id});
+            }
+        }
+
+        // Deep cascades, and large ones in PARALLEL mode, are freed by free_nodes(), which
+        // needs all of their nodes at hand. A path in the cascade cannot be longer than
+        // the difference of the generations at its ends.
+        std::vector<std::shared_ptr<Node>> doomed;
+        if (removal_mode != DEFERRED && !batching && graveyard.empty()) {
+            std::size_t size = 0;
+            std::size_t deepest = 0;
+            for (Node *n = cone; n != nullptr; n = n->next_in_cone) {
+                ++size;
+                deepest = std::max(deepest, n->longest);
+            }
+            if (deepest - node->longest >= DEEP_FREE_MIN || (removal_mode == PARALLEL && size >= parallel_min_cascade)) {
+                doomed.reserve(size);
+                for (Node *n = cone; n != nullptr; n = n->next_in_cone) {
+                    doomed.push_back(n->iter->second.lock());
+                }
+            }
+        }
+
+        // In a batch the child set entries are kept for undo instead of being freed
+        UndoRecord record;
+        record.type = UndoRecord::REMOVED;
+        if (batching) {
+            // Comparisons and allocations first, extracting by iterator compares nothing
+            std::vector<typename ChildSet::iterator> entries;
+            entries.reserve(node->parents.size());
+            for (Node *p : node->parents) {
+                entries.push_back(p->children.find(node));
+                assert(entries.back() != p->children.end());
+            }
+            reserve_more(undo_log, 1);
+            std::size_t size = 0;
+            for (Node *n = cone; n != nullptr; n = n->next_in_cone) {
+                ++size;
+            }
+            record.cone.reserve(size);
+            record.detached.reserve(entries.size());
+            record.detached_from.reserve(entries.size());
+            for (Node *n = cone; n != nullptr; n = n->next_in_cone) {
+                record.cone.push_back(n);
+            }
+            std::size_t i = 0;
+            for (Node *p : node->parents) {
+                record.detached.push_back(p->children.extract(entries[i++]));
+                record.detached_from.push_back(p);
+            }
+            record.entries = std::move(entries);
+        } else {
+            Transaction<ChildSet> t;
+            for (auto &p : node->get_parent_set()) {
+                auto i = p->get_child_set().find(node);
+                assert(i != p->get_child_set().end());
+                t.record_removal(p->get_child_set(), i);
+            }
+            if (log != nullptr) {
+                log->log_remove(base_remove_id);
+            }
+            t.commit();
+        }
+
+        // Nothing below throws, the detached subgraph is only flagged here
+        if (batching) {
+            record.node = node;
+            undo_log.push_back(std::move(record));
+        }
+        // The citations of the removed node and every citation of its cascade
+        std::size_t citations = 0;
+        for (Node *p : node->parents) {
+            citations += !p->tombstoned;
+        }
+        for (Node *n = cone; n != nullptr; n = n->next_in_cone) {
+            citations += n->children.size();
+            n->tombstoned = true;
+            --generations[n->longest];
+            ++cone_size;
+        }
+        live_publications -= cone_size;
+        live_citations -= citations;
+        if (batching) {
+            undo_log.back().citations = citations;
+        }
+        // Survivors that lost a parent can only get shallower, no reservation needed
+        DepthWorklist work;
+        for (Node *n = cone; n != nullptr; n = n->next_in_cone) {
+            for (auto &c : n->children) {
+                if (!c->tombstoned) {
+                    work.push(c.get());
+                }
+            }
+        }
+        settle_depths(work);
+        if (!doomed.empty()) {
+            // free_nodes() tells the cone by its in_cone flags, which die with it
+            guard.cone = nullptr;
+            node.reset();
+            free_nodes(doomed, removal_mode == PARALLEL
+                               ? worker_count(removal_threads, doomed.size() / PARALLEL_FREE_PER_WORKER) : 1);
+        }
+        if (removal_mode == DEFERRED && !batching) {
+            node->queued = true;
+            graveyard.push_back(std::move(node));
+        }
+        ++version;
+        publish(events);
+        return OK;
+    }
+
+public:
+    friend std::ostream &operator<<(std::ostream &os, const CitationGraph &cg) {
+        for (auto &pair : *cg.publication_ids) {
+            std::shared_ptr<Node> node = (pair.second.lock());
+            if (node->is_tombstoned()) {
+                continue;
+            }
+            os << "Children of " << pair.first << ": ";
+            for (auto const &c : node->get_child_set()) {
+                os << c->get_id() << " ";
+            }
+            os << std::endl;
+            os << "Parents of " << pair.first << ": ";
+            std::set<NodeId> s;
+            for (auto const &p: node->get_parent_set()) {
+                if (!p->is_tombstoned()) {
+                    s.insert(p->get_id());
+                }
+            }
+            for (auto const &p: s) {
+                os << p << " ";
+            }
+            os << std::endl;
+        }
+        os << std::endl;
+        return os;
+
+    }
+
+    std::string to_string(){
+       std::ostringstream stream;
+       stream << *this;
+       return stream.str();
+    }
+};
+
+/**
+ * Read-only citation graph produced by CitationGraph::freeze(). Publications are numbered in
+ * id order, ids are found by binary search, and both directions of the citations are CSR
+ * arrays of 32-bit indices: no per-node allocations and no reference counting. Nothing is
+ * ever modified after construction, so any number of threads may read it without locking.
+ */
+template<typename Publication>
+class FrozenCitationGraph {
+private:
+    using NodeId = typename Publication::id_type;
+    using Index = std::uint32_t;
+
+    std::vector<NodeId> ids;
+    // Children of i are children[child_offsets[i]] .. children[child_offsets[i + 1] - 1], by id
+    std::vector<Index> child_offsets;
+    std::vector<Index> children;
+    std::vector<Index> parent_offsets;
+    std::vector<Index> parents;
+    std::deque<Publication> publications;
+    Index source;
+
+    template<typename>
+    friend class CitationGraph;
+
+    FrozenCitationGraph(std::vector<NodeId> &&node_ids, std::vector<std::size_t> const &offsets,
+                        std::vector<std::size_t> const &targets, std::size_t source_index)
+        : ids(std::move(node_ids)), source(static_cast<Index>(source_index)) {
+        if (ids.size() >= std::numeric_limits<Index>::max() || targets.size() >= std::numeric_limits<Index>::max()) {
+            throw std::length_error("FrozenCitationGraph");
+        }
+        std::size_t n = ids.size();
+        child_offsets.assign(offsets.begin(), offsets.end());
+        children.assign(targets.begin(), targets.end());
+
+        // Transposed by counting, sources are visited in id order so parents end up sorted too
+        parent_offsets.assign(n + 1, 0);
+        for (Index target : children) {
+            ++parent_offsets[target + 1];
+        }
+        for (std::size_t i = 0; i < n; ++i) {
+            parent_offsets[i + 1] += parent_offsets[i];
+        }
+        parents.resize(children.size());
+        std::vector<Index> next(parent_offsets.begin(), parent_offsets.end() - 1);
+        for (std::size_t i = 0; i < n; ++i) {
+            for (Index e = child_offsets[i]; e < child_offsets[i + 1]; ++e) {
+                parents[next[children[e]]++] = static_cast<Index>(i);
+            }
+        }
+
+        for (NodeId const &id : ids) {
+            publications.emplace_back(id);
+        }
+    }
+
+    Index index_of(NodeId const &id) const {
+        auto iter = std::lower_bound(ids.begin(), ids.end(), id);
+        if (iter == ids.end() || id < *iter) {
+            throw PublicationNotFound();
+        }
+        return static_cast<Index>(iter - ids.begin());
+    }
+
+    std::vector<NodeId> to_ids(std::vector<Index> const &adjacency, Index first, Index last) const {
+        std::vector<NodeId> result;
+        result.reserve(last - first);
+        for (Index e = first; e < last; ++e) {
+            result.push_back(ids[adjacency[e]]);
+        }
+        return result;
+    }
+
+public:
+    NodeId get_root_id() const {
+        return ids[source];
+    }
+
+    std::vector<NodeId> get_children(NodeId const &id) const {
+        Index i = index_of(id);
+        return to_ids(children, child_offsets[i], child_offsets[i + 1]);
+    }
+
+    std::vector<NodeId> get_parents(NodeId const &id) const {
+        Index i = index_of(id);
+        return to_ids(parents, parent_offsets[i], parent_offsets[i + 1]);
+    }
+
+    bool exists(NodeId const &id) const {
+        return std::binary_search(ids.begin(), ids.end(), id);
+    }
+
+    const Publication &operator[](NodeId const &id) const {
+        return publications[index_of(id)];
+    }
+
+    // Number of publications, the root included
+    std::size_t size() const noexcept {
+        return ids.size();
+    }
+};
+
+/**
+ * Double buffering for graphs rebuilt in the background. Readers acquire() an immutable
+ * snapshot and keep using it for as long as they hold it, a writer builds a new graph on its
+ * own thread and publish()es it in O(1). Replaced snapshots are retired rather than freed, so
+ * the last reader to drop one never pays for its destruction; reclaim() frees them from
+ * whichever thread calls it.
+ */
+template<typename Publication>
+class CitationGraphHandle {
+public:
+    using Snapshot = std::shared_ptr<const CitationGraph<Publication>>;
+
+    explicit CitationGraphHandle(CitationGraph<Publication> &&graph)
+        : current(std::make_shared<const CitationGraph<Publication>>(std::move(graph))) {}
+
+    Snapshot acquire() const noexcept {
+        return std::atomic_load(&current);
+    }
+
+    // Strong guarantee, the only allocations happen before the swap
+    void publish(CitationGraph<Publication> &&graph) {
+        publish(std::make_shared<const CitationGraph<Publication>>(std::move(graph)));
+    }
+
+    void publish(Snapshot graph) {
+        std::lock_guard<std::mutex> lock(retired_mutex);
+        retired.reserve(retired.size() + 1);
+        retired.push_back(std::atomic_exchange(&current, std::move(graph)));
+    }
+
+    // Destroys the retired snapshots no reader holds any more, returns how many
+    std::size_t reclaim() {
+        std::vector<Snapshot> unused;
+        {
+            std::lock_guard<std::mutex> lock(retired_mutex);
+            auto in_use = std::partition(retired.begin(), retired.end(),
+                                         [](Snapshot const &s) { return s.use_count() > 1; });
+            unused.assign(std::make_move_iterator(in_use), std::make_move_iterator(retired.end()));
+            retired.erase(in_use, retired.end());
+        }
+        return unused.size();
+    }
+
+private:
+    Snapshot current;
+    std::mutex retired_mutex;
+    std::vector<Snapshot> retired;
 };
 
 #endif
@@ -0,0 +1,184 @@
+#ifndef CITATION_QUERY_SCHEDULER_H
+#define CITATION_QUERY_SCHEDULER_H
+
+#include <vector>
+#include <future>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <variant>
+#include "citation_graph.h"
+
+/**
+ * Asynchronous queries against the current snapshot of a CitationGraphHandle. Every query is
+ * answered through a future; a query fails with PublicationNotFound where its synchronous
+ * counterpart would throw it.
+ *
+ * Queries are queued, and a worker takes everything queued since its last wake-up as one
+ * batch, answered against a single snapshot. Queries of one kind go through one batched
+ * call of CitationGraph, which searches many ids at a time in the probe index of the
+ * snapshot and prefetches adjacency ahead, see CitationGraph::children_many(). The busier
+ * the callers, the larger the batches. Queries still queued on destruction are answered
+ * before the workers exit.
+ */
+template<typename Publication>
+class CitationQueryScheduler {
+private:
+    using NodeId = typename Publication::id_type;
+    using Ids = std::vector<NodeId>;
+
+    enum Kind {
+        EXISTS, CHILDREN, PARENTS, ANCESTORS
+    };
+
+    struct Query {
+        Kind kind;
+        NodeId id;
+        // Answer of an EXISTS query, or of any other kind
+        std::variant<std::promise<bool>, std::promise<Ids>> answer;
+    };
+
+    CitationGraphHandle<Publication> &handle;
+    std::mutex queue_mutex;
+    std::condition_variable queue_ready;
+    std::vector<Query> queue;
+    bool stopping = false;
+    std::vector<std::thread> workers;
+
+    template<typename T>
+    std::future<T> submit(Kind kind, NodeId const &id) {
+        std::promise<T> promise;
+        std::future<T> result = promise.get_future();
+        {
+            std::lock_guard<std::mutex> lock(queue_mutex);
+            queue.push_back(Query{kind, id, std::move(promise)});
+        }
+        queue_ready.notify_one();
+        return result;
+    }
+
+    void serve() {
+        std::vector<Query> batch;
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> lock(queue_mutex);
+                queue_ready.wait(lock, [this] { return stopping || !queue.empty(); });
+                if (queue.empty()) {
+                    return;
+                }
+                batch.swap(queue);
+            }
+            answer(*handle.acquire(), batch);
+            batch.clear();
+        }
+    }
+
+    /**
+     * Every query of batch gets its answer, or the exception that kept it from one. Answers
+     * are handed out newest first: a caller waiting for its oldest query is woken once, with
+     * its later queries already answered.
+     */
+    static void answer(CitationGraph<Publication> const &graph, std::vector<Query> &batch) noexcept {
+        try {
+            // Ids of the queries of each kind, a query is element position[i] of its kind
+            std::vector<std::size_t> position(batch.size());
+            Ids ids[ANCESTORS];
+            for (std::size_t i = 0; i < batch.size(); ++i) {
+                if (batch[i].kind != ANCESTORS) {
+                    position[i] = ids[batch[i].kind].size();
+                    ids[batch[i].kind].push_back(batch[i].id);
+                }
+            }
+            std::vector<bool> found = graph.exists_many(ids[EXISTS]);
+            auto children = graph.children_many(ids[CHILDREN]);
+            auto parents = graph.parents_many(ids[PARENTS]);
+
+            for (std::size_t i = batch.size(); i-- > 0;) {
+                Query &q = batch[i];
+                if (q.kind == EXISTS) {
+                    std::get<std::promise<bool>>(q.answer).set_value(found[position[i]]);
+                    continue;
+                }
+                auto &promise = std::get<std::promise<Ids>>(q.answer);
+                if (q.kind == ANCESTORS) {
+                    // Memoized by the snapshot, repeated ids are answered from its cache
+                    try {
+                        promise.set_value(graph.get_ancestors(q.id));
+                    } catch (...) {
+                        promise.set_exception(std::current_exception());
+                    }
+                    continue;
+                }
+                auto &set = (q.kind == CHILDREN ? children : parents)[position[i]];
+                if (set) {
+                    promise.set_value(std::move(*set));
+                } else {
+                    promise.set_exception(std::make_exception_ptr(PublicationNotFound()));
+                }
+            }
+        } catch (...) {
+            // Only queries that are still unanswered take the failure
+            for (Query &q : batch) {
+                std::visit([](auto &promise) {
+                    try {
+                        promise.set_exception(std::current_exception());
+                    } catch (std::future_error &) {
+                    }
+                }, q.answer);
+            }
+        }
+    }
+
+    void stop() noexcept {
+        {
+            std::lock_guard<std::mutex> lock(queue_mutex);
+            stopping = true;
+        }
+        queue_ready.notify_all();
+        for (auto &worker : workers) {
+            worker.join();
+        }
+        workers.clear();
+    }
+
+public:
+    // threads 0 picks one worker per hardware thread
+    explicit CitationQueryScheduler(CitationGraphHandle<Publication> &handle, unsigned threads = 1) : handle(handle) {
+        threads = threads != 0 ? threads : std::max(1u, std::thread::hardware_concurrency());
+        workers.reserve(threads);
+        try {
+            for (unsigned i = 0; i < threads; ++i) {
+                workers.emplace_back([this] { serve(); });
+            }
+        } catch (...) {
+            stop();
+            throw;
+        }
+    }
+
+    CitationQueryScheduler(CitationQueryScheduler const &) = delete;
+
+    CitationQueryScheduler &operator=(CitationQueryScheduler const &) = delete;
+
+    ~CitationQueryScheduler() {
+        stop();
+    }
+
+    std::future<bool> exists(NodeId const &id) {
+        return submit<bool>(EXISTS, id);
+    }
+
+    std::future<Ids> get_children(NodeId const &id) {
+        return submit<Ids>(CHILDREN, id);
+    }
+
+    std::future<Ids> get_parents(NodeId const &id) {
+        return submit<Ids>(PARENTS, id);
+    }
+
+    std::future<Ids> get_ancestors(NodeId const &id) {
+        return submit<Ids>(ANCESTORS, id);
+    }
+};
+
+#endif //CITATION_QUERY_SCHEDULER_H
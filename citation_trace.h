@@ -0,0 +1,353 @@
+#ifndef CITATION_TRACE_H
+#define CITATION_TRACE_H
+
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <istream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <ostream>
+#include <streambuf>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+class TraceFormatError : public std::exception {
+    char const *what() const noexcept override { return "TraceFormatError"; }
+};
+
+/**
+ * One traced graph operation. Records have a fixed size, so rings and dumps are plain arrays.
+ * Ids are kept as text, truncated to their last ID_BYTES characters, which is the
+ * distinctive part of a DOI. Unused id bytes are zero.
+ */
+struct TraceRecord {
+    static constexpr std::size_t ID_BYTES = 24;
+    // Status of an operation left by an exception, other values are CitationGraph::Status
+    static constexpr std::uint8_t THROWN = 0xff;
+
+    enum Op : std::uint8_t {
+        CREATE = 1, ADD_CITATION, REMOVE, RECLAIM, BATCH_COMMIT, BATCH_ROLLBACK
+    };
+
+    // Steady clock, nanoseconds
+    std::uint64_t start_ns;
+    std::uint64_t duration_ns;
+    // Parents of a create, publications removed or reclaimed, mutations committed or undone
+    std::uint32_t cascade;
+    // Index of the ring, one ring per thread
+    std::uint16_t thread;
+    std::uint8_t op;
+    std::uint8_t status;
+    char id[ID_BYTES];
+    // First parent of a create, parent of a citation
+    char other_id[ID_BYTES];
+
+    static char const *op_name(std::uint8_t op) noexcept {
+        static char const *names[] = {"?", "create", "add_citation", "remove", "reclaim", "batch_commit",
+                                      "batch_rollback"};
+        return op <= BATCH_ROLLBACK ? names[op] : names[0];
+    }
+
+    // Keeps the last ID_BYTES characters of text
+    static void store_id(char const *text, std::size_t size, char (&out)[ID_BYTES]) noexcept {
+        std::size_t kept = std::min(size, ID_BYTES);
+        std::memcpy(out, text + size - kept, kept);
+    }
+};
+
+static_assert(std::is_trivially_copyable<TraceRecord>::value, "TraceRecord is dumped as raw bytes");
+
+/**
+ * Text form of ids in trace records. Integers and strings are encoded without allocating,
+ * other types fall back to their operator<<. Specialize it for a cheaper encoding.
+ */
+template<typename T, typename Enable = void>
+struct TraceKey {
+    static void encode(T const &value, char (&out)[TraceRecord::ID_BYTES]) noexcept {
+        // Writes into a fixed buffer, text that does not fit is cut off
+        struct FixedBuffer : std::streambuf {
+            char text[4 * TraceRecord::ID_BYTES];
+
+            FixedBuffer() { setp(text, text + sizeof(text)); }
+
+            std::size_t size() const { return pptr() - text; }
+        } buffer;
+        try {
+            std::ostream os(&buffer);
+            os << value;
+        } catch (...) {
+        }
+        TraceRecord::store_id(buffer.text, buffer.size(), out);
+    }
+};
+
+template<typename T>
+struct TraceKey<T, typename std::enable_if<std::is_integral<T>::value>::type> {
+    static void encode(T const &value, char (&out)[TraceRecord::ID_BYTES]) noexcept {
+        char text[24];
+        char *end = std::to_chars(text, text + sizeof(text), value).ptr;
+        TraceRecord::store_id(text, end - text, out);
+    }
+};
+
+template<>
+struct TraceKey<std::string> {
+    static void encode(std::string const &value, char (&out)[TraceRecord::ID_BYTES]) noexcept {
+        TraceRecord::store_id(value.data(), value.size(), out);
+    }
+};
+
+/**
+ * Process-wide tracing into per-thread rings of TraceRecords. Each thread writes only its own
+ * ring and never blocks, except on its first record, which registers the ring. A full ring
+ * overwrites its oldest records, so the trace keeps the recent past of every thread at a
+ * fixed memory cost. Off until enable() is called; a disabled trace costs one relaxed load
+ * per operation.
+ *
+ * The ring of an exited thread goes to the next new thread once snapshot() has copied it.
+ * There are at most MAX_RINGS rings: past that, new threads take over the rings of exited
+ * threads that were never copied, and while every ring has a live thread the records of
+ * new threads are dropped.
+ */
+class CitationTrace {
+private:
+    struct Ring {
+        std::vector<TraceRecord> records;
+        // Records ever started and finished, a record is written between the two counts
+        std::atomic<std::uint64_t> started{0};
+        std::atomic<std::uint64_t> written{0};
+        std::uint16_t thread;
+        // Under the mutex: the thread of the ring exited, and snapshot() copied it since
+        bool retired = false;
+        bool copied = false;
+
+        Ring(std::size_t capacity, std::uint16_t thread) : records(capacity), thread(thread) {}
+    };
+
+    std::atomic<bool> on{false};
+    std::mutex mutex;
+    std::size_t capacity = 1 << 14;
+    // Bumped by clear(), threads register a new ring when theirs is stale
+    std::atomic<std::uint64_t> generation{0};
+    std::vector<std::shared_ptr<Ring>> rings;
+
+    static CitationTrace &instance() noexcept {
+        static CitationTrace trace;
+        return trace;
+    }
+
+    // A copied ring of an exited thread, then a new one, then any ring of an exited thread
+    std::shared_ptr<Ring> take_ring() {
+        auto reusable = std::find_if(rings.begin(), rings.end(), [](auto const &r) { return r->retired && r->copied; });
+        if (reusable == rings.end() && rings.size() < MAX_RINGS) {
+            rings.push_back(std::make_shared<Ring>(capacity, static_cast<std::uint16_t>(rings.size())));
+            return rings.back();
+        }
+        if (reusable == rings.end()) {
+            reusable = std::find_if(rings.begin(), rings.end(), [](auto const &r) { return r->retired; });
+            if (reusable == rings.end()) {
+                throw std::length_error("CitationTrace: every ring has a live thread");
+            }
+        }
+        Ring &ring = **reusable;
+        ring.records.assign(capacity, TraceRecord());
+        ring.started.store(0, std::memory_order_relaxed);
+        ring.written.store(0, std::memory_order_relaxed);
+        ring.retired = false;
+        ring.copied = false;
+        return *reusable;
+    }
+
+    static Ring *local_ring() {
+        struct Local {
+            std::shared_ptr<Ring> ring;
+            std::uint64_t generation = 0;
+
+            ~Local() {
+                if (ring != nullptr) {
+                    std::lock_guard<std::mutex> lock(instance().mutex);
+                    ring->retired = true;
+                }
+            }
+        };
+        thread_local Local local;
+        CitationTrace &trace = instance();
+        std::uint64_t current = trace.generation.load(std::memory_order_acquire);
+        if (local.ring == nullptr || local.generation != current) {
+            std::lock_guard<std::mutex> lock(trace.mutex);
+            local.ring = trace.take_ring();
+            local.generation = current;
+        }
+        return local.ring.get();
+    }
+
+public:
+    // Ring indices are 16 bit, see TraceRecord::thread
+    static constexpr std::size_t MAX_RINGS = 1024;
+    static_assert(MAX_RINGS <= UINT16_MAX + 1, "ring indices must fit TraceRecord::thread");
+
+    static constexpr char MAGIC[8] = {'C', 'G', 'T', 'R', 'A', 'C', 'E', '1'};
+
+    // Starts recording, threads that record for the first time get rings of this many records
+    static void enable(std::size_t records_per_thread = 1 << 14) {
+        CitationTrace &trace = instance();
+        {
+            std::lock_guard<std::mutex> lock(trace.mutex);
+            trace.capacity = std::max<std::size_t>(records_per_thread, 1);
+        }
+        trace.on.store(true, std::memory_order_relaxed);
+    }
+
+    static void disable() noexcept {
+        instance().on.store(false, std::memory_order_relaxed);
+    }
+
+    static bool enabled() noexcept {
+        return instance().on.load(std::memory_order_relaxed);
+    }
+
+    // Drops every ring, their threads start new ones on their next record
+    static void clear() {
+        CitationTrace &trace = instance();
+        std::lock_guard<std::mutex> lock(trace.mutex);
+        trace.rings.clear();
+        trace.generation.fetch_add(1, std::memory_order_release);
+    }
+
+    static std::uint64_t now() noexcept {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // Records are dropped if a new thread gets no ring, see MAX_RINGS
+    static void record(TraceRecord entry) noexcept {
+        Ring *ring;
+        try {
+            ring = local_ring();
+        } catch (...) {
+            return;
+        }
+        std::uint64_t n = ring->written.load(std::memory_order_relaxed);
+        entry.thread = ring->thread;
+        ring->started.store(n + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        ring->records[n % ring->records.size()] = entry;
+        ring->written.store(n + 1, std::memory_order_release);
+    }
+
+    /**
+     * Copies what the rings hold, oldest record of each ring first. Safe while other threads
+     * keep recording: records they may have overwritten during the copy are left out.
+     */
+    static std::vector<TraceRecord> snapshot() {
+        CitationTrace &trace = instance();
+        std::lock_guard<std::mutex> lock(trace.mutex);
+        std::vector<TraceRecord> result;
+        for (auto const &ring : trace.rings) {
+            std::size_t size = ring->records.size();
+            std::uint64_t end = ring->written.load(std::memory_order_acquire);
+            std::uint64_t begin = end > size ? end - size : 0;
+            std::size_t first = result.size();
+            for (std::uint64_t i = begin; i < end; ++i) {
+                result.push_back(ring->records[i % size]);
+            }
+            // Records started since then reused the slots of the oldest ones
+            std::atomic_thread_fence(std::memory_order_acquire);
+            std::uint64_t after = ring->started.load(std::memory_order_relaxed);
+            std::uint64_t torn = after > size ? after - size : 0;
+            if (torn > begin) {
+                std::size_t dropped = static_cast<std::size_t>(std::min(torn, end) - begin);
+                result.erase(result.begin() + first, result.begin() + first + dropped);
+            }
+            ring->copied = ring->retired;
+        }
+        return result;
+    }
+
+    /**
+     * Writes a snapshot in the dump format read by load() and the trace_decode tool: MAGIC,
+     * the record size and the record count as 32 bit integers, then the raw records.
+     * Returns the number of records written.
+     */
+    static std::size_t dump(std::ostream &out) {
+        std::vector<TraceRecord> records = snapshot();
+        std::uint32_t header[2] = {sizeof(TraceRecord), static_cast<std::uint32_t>(records.size())};
+        out.write(MAGIC, sizeof(MAGIC));
+        out.write(reinterpret_cast<char const *>(header), sizeof(header));
+        out.write(reinterpret_cast<char const *>(records.data()), records.size() * sizeof(TraceRecord));
+        return records.size();
+    }
+
+    // Reads a dump, throws TraceFormatError if it is truncated or was written by another layout
+    static std::vector<TraceRecord> load(std::istream &in) {
+        char magic[sizeof(MAGIC)];
+        std::uint32_t header[2];
+        if (!in.read(magic, sizeof(magic)) || std::memcmp(magic, MAGIC, sizeof(MAGIC)) != 0
+            || !in.read(reinterpret_cast<char *>(header), sizeof(header)) || header[0] != sizeof(TraceRecord)) {
+            throw TraceFormatError();
+        }
+        std::vector<TraceRecord> records(header[1]);
+        if (!in.read(reinterpret_cast<char *>(records.data()), records.size() * sizeof(TraceRecord))) {
+            throw TraceFormatError();
+        }
+        return records;
+    }
+};
+
+/**
+ * Traces the operation running in its lifetime. Statuses are set by finish(), an operation
+ * that never gets there is recorded as THROWN.
+ */
+class TraceScope {
+private:
+    TraceRecord record;
+    bool active;
+
+public:
+    explicit TraceScope(TraceRecord::Op op) noexcept : active(CitationTrace::enabled()) {
+        if (active) {
+            std::memset(&record, 0, sizeof(record));
+            record.op = op;
+            record.status = TraceRecord::THROWN;
+            record.start_ns = CitationTrace::now();
+        }
+    }
+
+    template<typename Id>
+    TraceScope(TraceRecord::Op op, Id const &id, Id const *other = nullptr) noexcept : TraceScope(op) {
+        if (active) {
+            TraceKey<Id>::encode(id, record.id);
+            if (other != nullptr) {
+                TraceKey<Id>::encode(*other, record.other_id);
+            }
+        }
+    }
+
+    TraceScope(TraceScope const &) = delete;
+
+    TraceScope &operator=(TraceScope const &) = delete;
+
+    template<typename Status>
+    Status finish(Status status, std::size_t cascade) noexcept {
+        if (active) {
+            record.status = static_cast<std::uint8_t>(status);
+            record.cascade = static_cast<std::uint32_t>(std::min<std::size_t>(cascade, UINT32_MAX));
+        }
+        return status;
+    }
+
+    ~TraceScope() {
+        if (active) {
+            record.duration_ns = CitationTrace::now() - record.start_ns;
+            CitationTrace::record(record);
+        }
+    }
+};
+
+#endif //CITATION_TRACE_H
@@ -0,0 +1,488 @@
+#ifndef CITATION_WAL_H
+#define CITATION_WAL_H
+
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <memory>
+#include <type_traits>
+#include <random>
+#include <chrono>
+#include <unistd.h>
+#include "citation_graph.h"
+
+class WriteAheadLogError : public std::exception {
+    char const *what() const noexcept override { return "WriteAheadLogError"; }
+};
+
+/**
+ * Binary encoding of ids in the write-ahead log. Specialize it for other id types,
+ * decode throws WriteAheadLogError when the input ends too early.
+ */
+template<typename T, typename Enable = void>
+struct WalCodec;
+
+template<typename T>
+struct WalCodec<T, typename std::enable_if<std::is_arithmetic<T>::value>::type> {
+    static void encode(T const &value, std::vector<char> &out) {
+        char const *bytes = reinterpret_cast<char const *>(&value);
+        out.insert(out.end(), bytes, bytes + sizeof(T));
+    }
+
+    static T decode(char const *&pos, char const *end) {
+        if (end - pos < static_cast<std::ptrdiff_t>(sizeof(T))) {
+            throw WriteAheadLogError();
+        }
+        T value;
+        std::memcpy(&value, pos, sizeof(T));
+        pos += sizeof(T);
+        return value;
+    }
+};
+
+template<>
+struct WalCodec<std::string> {
+    static void encode(std::string const &value, std::vector<char> &out) {
+        WalCodec<std::uint32_t>::encode(static_cast<std::uint32_t>(value.size()), out);
+        out.insert(out.end(), value.begin(), value.end());
+    }
+
+    static std::string decode(char const *&pos, char const *end) {
+        std::uint32_t size = WalCodec<std::uint32_t>::decode(pos, end);
+        if (end - pos < static_cast<std::ptrdiff_t>(size)) {
+            throw WriteAheadLogError();
+        }
+        std::string value(pos, size);
+        pos += size;
+        return value;
+    }
+};
+
+/**
+ * Append-only log of committed graph mutations.
+ *
+ * Record layout: type (1 byte), payload size (4 bytes), FNV-1a checksum of the payload
+ * (4 bytes), payload. Records are encoded into an in-memory group and written out once the
+ * group reaches group_bytes or on flush(), so a burst of mutations costs one write (and one
+ * fsync when sync is set). Until then a crash of the process loses them, although the graph
+ * has applied them and told its observers: up to group_bytes of mutations. With group_bytes
+ * FLUSH_ON_COMMIT every mutation, and every batch as a whole, is written before it returns.
+ *
+ * A torn or corrupt tail is ignored by replay and cut off when the log is opened again, so
+ * records appended after a crash are not hidden behind it. The records of a batch follow a
+ * BATCH record holding their count, replay drops a batch that is not complete.
+ *
+ * A log file starts with a LOG record holding a random id, and a snapshot names the log it
+ * covers. checkpoint() replaces the snapshot first and the log after it, if a crash comes in
+ * between, recover() skips the log the snapshot already covers.
+ */
+template<typename NodeId>
+class WriteAheadLog : public CitationLog<NodeId> {
+public:
+    enum RecordType : std::uint8_t {
+        CREATE = 1, CITATION = 2, REMOVE = 3, ROOT = 4, LOG = 5, BATCH = 6
+    };
+
+    // Group size that writes out every committed mutation, see the class comment
+    static constexpr std::size_t FLUSH_ON_COMMIT = 1;
+
+    /**
+     * Appends to the log at path after its last record that replay would apply, a new log
+     * gets its LOG record right away.
+     */
+    explicit WriteAheadLog(std::string path, std::size_t group_bytes = 1 << 16, bool sync = false)
+        : path(std::move(path)), group_bytes(group_bytes), sync(sync) {
+        std::vector<char> head = read_file(this->path);
+        std::size_t length = valid_length(head);
+        if (length < head.size() && ::truncate(this->path.c_str(), static_cast<off_t>(length)) != 0) {
+            throw WriteAheadLogError();
+        }
+        head.resize(length);
+        open("ab");
+        group.reserve(group_bytes);
+        if (head.empty()) {
+            log_id = fresh_log_id();
+            encode_log_record(group, log_id);
+            flush();
+        } else {
+            log_id = head_log_id(head);
+        }
+    }
+
+    WriteAheadLog(WriteAheadLog const &) = delete;
+
+    WriteAheadLog &operator=(WriteAheadLog const &) = delete;
+
+    ~WriteAheadLog() override {
+        try {
+            flush();
+        } catch (...) {
+        }
+    }
+
+    void log_create(NodeId const &id, std::vector<NodeId> const &parent_ids) override {
+        append(CREATE, [&] {
+            WalCodec<NodeId>::encode(id, group);
+            WalCodec<std::uint32_t>::encode(static_cast<std::uint32_t>(parent_ids.size()), group);
+            for (NodeId const &parent_id : parent_ids) {
+                WalCodec<NodeId>::encode(parent_id, group);
+            }
+        });
+    }
+
+    void log_citation(NodeId const &child_id, NodeId const &parent_id) override {
+        append(CITATION, [&] {
+            WalCodec<NodeId>::encode(child_id, group);
+            WalCodec<NodeId>::encode(parent_id, group);
+        });
+    }
+
+    void log_remove(NodeId const &id) override {
+        append(REMOVE, [&] { WalCodec<NodeId>::encode(id, group); });
+    }
+
+    // The records of a batch stay in the group until it commits, an abandoned batch leaves none
+    void begin_batch() override {
+        in_batch = true;
+        batch_start = group.size();
+        try {
+            append(BATCH, [&] { WalCodec<std::uint32_t>::encode(0, group); });
+        } catch (...) {
+            in_batch = false;
+            throw;
+        }
+        batch_records = 0;
+    }
+
+    void end_batch(bool committed) override {
+        in_batch = false;
+        if (!committed) {
+            group.resize(batch_start);
+            return;
+        }
+        // The count goes into the BATCH record once it is known
+        std::uint32_t count = static_cast<std::uint32_t>(batch_records);
+        std::memcpy(&group[batch_start + 9], &count, sizeof(count));
+        std::uint32_t sum = checksum(&group[batch_start + 9], &group[batch_start + 9] + sizeof(count));
+        std::memcpy(&group[batch_start + 5], &sum, sizeof(sum));
+        if (group.size() >= group_bytes) {
+            flush();
+        }
+    }
+
+    // Writes the pending group to the file
+    void flush() {
+        if (group.empty()) {
+            return;
+        }
+        if (std::fwrite(group.data(), 1, group.size(), file.get()) != group.size() ||
+            std::fflush(file.get()) != 0 || (sync && ::fsync(fileno(file.get())) != 0)) {
+            throw WriteAheadLogError();
+        }
+        group.clear();
+    }
+
+    /**
+     * Writes a snapshot of graph to snapshot_path and starts a new, empty log, recovery then
+     * starts from the snapshot. Both files are replaced atomically, the snapshot first.
+     */
+    template<typename Publication>
+    void checkpoint(CitationGraph<Publication> const &graph, std::string const &snapshot_path) {
+        flush();
+        write_snapshot(graph, snapshot_path, log_id);
+        std::uint64_t id = fresh_log_id();
+        std::vector<char> head;
+        encode_log_record(head, id);
+        replace_file(path, head);
+        open("ab");
+        log_id = id;
+    }
+
+    /**
+     * Applies the records of the log at path to graph and returns how many were applied.
+     * Replay stops at the first incomplete or corrupt record, or at the batch that holds it.
+     */
+    template<typename Publication>
+    static std::size_t replay(std::string const &path, CitationGraph<Publication> &graph) {
+        return replay_bytes(read_file(path), graph);
+    }
+
+    /**
+     * Rebuilds a graph from the snapshot written by checkpoint() and the log written after it,
+     * a log the snapshot already covers is skipped. Returns nullptr when there is no snapshot.
+     */
+    template<typename Publication>
+    static std::unique_ptr<CitationGraph<Publication>> recover(std::string const &snapshot_path,
+                                                                std::string const &log_path) {
+        std::vector<char> bytes = read_file(snapshot_path);
+        char const *pos = bytes.data();
+        char const *end = pos + bytes.size();
+        std::uint8_t type;
+        char const *payload;
+        char const *payload_end;
+        if (!next_record(pos, end, type, payload, payload_end) || type != ROOT) {
+            return nullptr;
+        }
+        auto graph = std::make_unique<CitationGraph<Publication>>(WalCodec<NodeId>::decode(payload, payload_end));
+        bytes.erase(bytes.begin(), bytes.begin() + (pos - bytes.data()));
+        std::uint64_t covered = head_log_id(bytes);
+        replay_bytes(bytes, *graph);
+        std::vector<char> log = read_file(log_path);
+        if (covered == 0 || head_log_id(log) != covered) {
+            replay_bytes(log, *graph);
+        }
+        return graph;
+    }
+
+private:
+    struct FileCloser {
+        void operator()(std::FILE *f) const { std::fclose(f); }
+    };
+
+    std::string path;
+    std::size_t group_bytes;
+    bool sync;
+    std::unique_ptr<std::FILE, FileCloser> file;
+    std::vector<char> group;
+    std::size_t batch_start = 0;
+    std::size_t batch_records = 0;
+    bool in_batch = false;
+    // Id of the LOG record at the head of the file, 0 for a log without one
+    std::uint64_t log_id = 0;
+
+    void open(char const *mode) {
+        std::unique_ptr<std::FILE, FileCloser> opened(std::fopen(path.c_str(), mode));
+        if (opened == nullptr) {
+            throw WriteAheadLogError();
+        }
+        file = std::move(opened);
+    }
+
+    static std::uint32_t checksum(char const *begin, char const *end) noexcept {
+        std::uint32_t hash = 2166136261u;
+        for (char const *c = begin; c != end; ++c) {
+            hash = (hash ^ static_cast<std::uint8_t>(*c)) * 16777619u;
+        }
+        return hash;
+    }
+
+    static void encode_record(std::vector<char> &out, RecordType type, std::size_t header) {
+        std::uint32_t size = static_cast<std::uint32_t>(out.size() - header - 9);
+        std::uint32_t sum = checksum(out.data() + header + 9, out.data() + out.size());
+        out[header] = static_cast<char>(type);
+        std::memcpy(&out[header + 1], &size, sizeof(size));
+        std::memcpy(&out[header + 5], &sum, sizeof(sum));
+    }
+
+    static std::uint64_t fresh_log_id() {
+        std::random_device device;
+        std::uint64_t id = static_cast<std::uint64_t>(device()) << 32 ^ device() ^
+                           static_cast<std::uint64_t>(std::chrono::steady_clock::now().time_since_epoch().count());
+        return id != 0 ? id : 1;
+    }
+
+    static void encode_log_record(std::vector<char> &out, std::uint64_t id) {
+        std::size_t header = out.size();
+        out.resize(header + 9);
+        WalCodec<std::uint64_t>::encode(id, out);
+        encode_record(out, LOG, header);
+    }
+
+    // Id of the LOG record that bytes start with, 0 if they start with another record
+    static std::uint64_t head_log_id(std::vector<char> const &bytes) {
+        char const *pos = bytes.data();
+        std::uint8_t type;
+        char const *payload;
+        char const *payload_end;
+        if (!next_record(pos, pos + bytes.size(), type, payload, payload_end) || type != LOG) {
+            return 0;
+        }
+        return WalCodec<std::uint64_t>::decode(payload, payload_end);
+    }
+
+    // Strong guarantee: on failure the group is left as it was
+    template<typename F>
+    void append(RecordType type, F encode_payload) {
+        std::size_t header = group.size();
+        try {
+            group.resize(header + 9);
+            encode_payload();
+            encode_record(group, type, header);
+            if (group.size() >= group_bytes && !in_batch) {
+                flush();
+            }
+            batch_records += in_batch;
+        } catch (...) {
+            group.resize(header);
+            throw;
+        }
+    }
+
+    static bool next_record(char const *&pos, char const *end, std::uint8_t &type,
+                            char const *&payload, char const *&payload_end) noexcept {
+        if (end - pos < 9) {
+            return false;
+        }
+        std::uint32_t size;
+        std::uint32_t sum;
+        std::memcpy(&size, pos + 1, sizeof(size));
+        std::memcpy(&sum, pos + 5, sizeof(sum));
+        if (end - pos - 9 < static_cast<std::ptrdiff_t>(size) || checksum(pos + 9, pos + 9 + size) != sum) {
+            return false;
+        }
+        type = static_cast<std::uint8_t>(*pos);
+        payload = pos + 9;
+        payload_end = payload + size;
+        pos = payload_end;
+        return true;
+    }
+
+    // Length of the records that replay applies, up to a torn or corrupt one or an incomplete batch
+    static std::size_t valid_length(std::vector<char> const &bytes) noexcept {
+        char const *pos = bytes.data();
+        char const *end = pos + bytes.size();
+        char const *valid = pos;
+        std::uint8_t type;
+        char const *payload;
+        char const *payload_end;
+        while (next_record(pos, end, type, payload, payload_end) && type >= CREATE && type <= BATCH) {
+            if (type == BATCH) {
+                std::uint32_t count;
+                if (payload_end - payload < static_cast<std::ptrdiff_t>(sizeof(count))) {
+                    break;
+                }
+                std::memcpy(&count, payload, sizeof(count));
+                std::uint32_t i = 0;
+                while (i < count && next_record(pos, end, type, payload, payload_end)) {
+                    ++i;
+                }
+                if (i < count) {
+                    break;
+                }
+            }
+            valid = pos;
+        }
+        return static_cast<std::size_t>(valid - bytes.data());
+    }
+
+    // Contents of the file, none if it does not exist
+    static std::vector<char> read_file(std::string const &path) {
+        std::vector<char> bytes;
+        std::unique_ptr<std::FILE, FileCloser> in(std::fopen(path.c_str(), "rb"));
+        if (in == nullptr) {
+            return bytes;
+        }
+        char chunk[1 << 16];
+        for (std::size_t read; (read = std::fread(chunk, 1, sizeof(chunk), in.get())) > 0;) {
+            bytes.insert(bytes.end(), chunk, chunk + read);
+        }
+        return bytes;
+    }
+
+    // Writes bytes to a temporary file and renames it over path
+    static void replace_file(std::string const &path, std::vector<char> const &bytes) {
+        std::string temporary = path + ".tmp";
+        {
+            std::unique_ptr<std::FILE, FileCloser> out(std::fopen(temporary.c_str(), "wb"));
+            if (out == nullptr || std::fwrite(bytes.data(), 1, bytes.size(), out.get()) != bytes.size() ||
+                std::fflush(out.get()) != 0 || ::fsync(fileno(out.get())) != 0) {
+                throw WriteAheadLogError();
+            }
+        }
+        if (std::rename(temporary.c_str(), path.c_str()) != 0) {
+            throw WriteAheadLogError();
+        }
+    }
+
+    /**
+     * The snapshot is a ROOT record, the LOG record of the log it covers and CREATE records
+     * in topological order.
+     */
+    template<typename Publication>
+    static void write_snapshot(CitationGraph<Publication> const &graph, std::string const &snapshot_path,
+                               std::uint64_t covered) {
+        std::vector<char> out;
+        std::size_t header = out.size();
+        out.resize(9);
+        WalCodec<NodeId>::encode(graph.get_root_id(), out);
+        encode_record(out, ROOT, header);
+        encode_log_record(out, covered);
+
+        graph.visit_topological([&](NodeId const &id, std::vector<NodeId> const &parent_ids) {
+            header = out.size();
+            out.resize(header + 9);
+            WalCodec<NodeId>::encode(id, out);
+            WalCodec<std::uint32_t>::encode(static_cast<std::uint32_t>(parent_ids.size()), out);
+            for (NodeId const &parent_id : parent_ids) {
+                WalCodec<NodeId>::encode(parent_id, out);
+            }
+            encode_record(out, CREATE, header);
+        });
+
+        replace_file(snapshot_path, out);
+    }
+
+    // Mutations replayed from a log are not logged again
+    template<typename Publication>
+    static std::size_t replay_bytes(std::vector<char> const &bytes, CitationGraph<Publication> &graph) {
+        struct Detach {
+            CitationGraph<Publication> &graph;
+            CitationLog<NodeId> *log;
+
+            ~Detach() { graph.set_log(log); }
+        } detach{graph, graph.get_log()};
+        graph.set_log(nullptr);
+
+        char const *pos = bytes.data();
+        char const *end = pos + bytes.size();
+        std::size_t applied = 0;
+        std::uint8_t type;
+        char const *payload;
+        char const *payload_end;
+        while (next_record(pos, end, type, payload, payload_end)) {
+            switch (type) {
+                case CREATE: {
+                    NodeId id = WalCodec<NodeId>::decode(payload, payload_end);
+                    std::uint32_t count = WalCodec<std::uint32_t>::decode(payload, payload_end);
+                    std::vector<NodeId> parent_ids;
+                    parent_ids.reserve(count);
+                    for (std::uint32_t i = 0; i < count; ++i) {
+                        parent_ids.push_back(WalCodec<NodeId>::decode(payload, payload_end));
+                    }
+                    graph.create(id, parent_ids);
+                    break;
+                }
+                case CITATION: {
+                    NodeId child_id = WalCodec<NodeId>::decode(payload, payload_end);
+                    NodeId parent_id = WalCodec<NodeId>::decode(payload, payload_end);
+                    graph.add_citation(child_id, parent_id);
+                    break;
+                }
+                case REMOVE:
+                    graph.remove(WalCodec<NodeId>::decode(payload, payload_end));
+                    break;
+                case LOG:
+                    continue;
+                case BATCH: {
+                    // A batch is replayed only if all of its records made it to the file
+                    std::uint32_t count = WalCodec<std::uint32_t>::decode(payload, payload_end);
+                    char const *rest = pos;
+                    for (std::uint32_t i = 0; i < count; ++i) {
+                        if (!next_record(rest, end, type, payload, payload_end)) {
+                            return applied;
+                        }
+                    }
+                    continue;
+                }
+                default:
+                    throw WriteAheadLogError();
+            }
+            ++applied;
+        }
+        return applied;
+    }
+};
+
+#endif //CITATION_WAL_H
@@ -0,0 +1,447 @@
+#ifndef SHARDED_CITATION_GRAPH_H
+#define SHARDED_CITATION_GRAPH_H
+
+#include <vector>
+#include <memory>
+#include <unordered_map>
+#include <unordered_set>
+#include <functional>
+#include <future>
+#include <thread>
+#include <mutex>
+#include <shared_mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <numeric>
+#include <tuple>
+#include "citation_graph.h"
+
+/**
+ * Citation graph partitioned by id hash into shards, each with a reader-writer lock.
+ *
+ * Queries hold the shared locks of the shards they read, one at a time, and run on the
+ * calling thread. A mutation holds the exclusive locks of the shards it touches, taken in
+ * shard order so that writers never deadlock: a create or citation within one shard locks
+ * only that shard, and writes to different shards run concurrently. remove() locks every
+ * shard, as its cascade may reach any of them, and collects the cone in rounds run in
+ * parallel by the shard workers, each of which only touches its own shard.
+ */
+template<typename Publication, typename Hash = std::hash<typename Publication::id_type>>
+class ShardedCitationGraph {
+private:
+    using NodeId = typename Publication::id_type;
+    using IdSet = std::unordered_set<NodeId, Hash>;
+
+    struct Entry {
+        Publication value;
+        // Cited and citing publications, either of them may live on another shard
+        IdSet parents;
+        IdSet children;
+
+        // Scratch state of remove(), reset before it returns
+        bool in_cone = false;
+        std::size_t dead_parents = 0;
+
+        explicit Entry(NodeId const &id) : value(id) {}
+    };
+
+    struct Shard {
+        std::unordered_map<NodeId, Entry, Hash> nodes;
+        // Shared by queries, exclusive for mutations, see lock_shards()
+        std::shared_mutex lock;
+        // Nodes of this shard that remove() marked or counted
+        std::vector<NodeId> cone;
+        std::vector<NodeId> touched;
+
+        std::mutex queue_mutex;
+        std::condition_variable queue_ready;
+        std::vector<std::function<void()>> queue;
+        bool stopping = false;
+        std::thread worker;
+
+        Entry &at(NodeId const &id) {
+            auto iter = nodes.find(id);
+            if (iter == nodes.end()) {
+                throw PublicationNotFound();
+            }
+            return iter->second;
+        }
+    };
+
+    std::vector<std::unique_ptr<Shard>> shards;
+    Hash hash;
+    NodeId source_id;
+
+    std::size_t shard_of(NodeId const &id) const {
+        return hash(id) % shards.size();
+    }
+
+    static void serve(Shard &shard) {
+        std::vector<std::function<void()>> batch;
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> lock(shard.queue_mutex);
+                shard.queue_ready.wait(lock, [&shard] { return shard.stopping || !shard.queue.empty(); });
+                if (shard.queue.empty()) {
+                    return;
+                }
+                batch.swap(shard.queue);
+            }
+            for (auto &task : batch) {
+                task();
+            }
+            batch.clear();
+        }
+    }
+
+    void stop() noexcept {
+        for (auto &shard : shards) {
+            {
+                std::lock_guard<std::mutex> lock(shard->queue_mutex);
+                shard->stopping = true;
+            }
+            shard->queue_ready.notify_one();
+        }
+        for (auto &shard : shards) {
+            if (shard->worker.joinable()) {
+                shard->worker.join();
+            }
+        }
+    }
+
+    using ShardLocks = std::vector<std::unique_lock<std::shared_mutex>>;
+
+    // Exclusive locks of the shards in indices, in shard order, repeated shards are locked once
+    ShardLocks lock_shards(std::vector<std::size_t> indices) const {
+        std::sort(indices.begin(), indices.end());
+        indices.erase(std::unique(indices.begin(), indices.end()), indices.end());
+        ShardLocks locks;
+        locks.reserve(indices.size());
+        for (std::size_t i : indices) {
+            locks.emplace_back(shards[i]->lock);
+        }
+        return locks;
+    }
+
+    // Runs read(shard) on the calling thread under the shared lock of the shard of id
+    template<typename F>
+    auto read_shard(NodeId const &id, F read) const -> decltype(read(std::declval<Shard &>())) {
+        Shard &shard = *shards[shard_of(id)];
+        std::shared_lock<std::shared_mutex> lock(shard.lock);
+        return read(shard);
+    }
+
+    bool contains(NodeId const &id) const {
+        return shards[shard_of(id)]->nodes.count(id) != 0;
+    }
+
+    // Queues work(shard) on the worker of shard i, its result or exception ends up in the future
+    template<typename F>
+    auto post(std::size_t i, F work) const -> std::future<decltype(work(std::declval<Shard &>()))> {
+        using Result = decltype(work(std::declval<Shard &>()));
+        Shard &shard = *shards[i];
+        auto task = std::make_shared<std::packaged_task<Result()>>([&shard, work]() mutable { return work(shard); });
+        std::future<Result> result = task->get_future();
+        {
+            std::lock_guard<std::mutex> lock(shard.queue_mutex);
+            shard.queue.emplace_back([task] { (*task)(); });
+        }
+        shard.queue_ready.notify_one();
+        return result;
+    }
+
+    /**
+     * Runs work(shard, i) on every shard in parallel, the caller holds the locks it needs.
+     * Waits for all of them, even when one fails, as work refers to the caller's stack, then
+     * rethrows the first failure.
+     */
+    template<typename F>
+    void on_all_shards(F work) const {
+        std::vector<std::future<void>> pending;
+        pending.reserve(shards.size());
+        std::exception_ptr failure;
+        for (std::size_t i = 0; i < shards.size() && failure == nullptr; ++i) {
+            try {
+                pending.push_back(post(i, [&work, i](Shard &shard) { work(shard, i); }));
+            } catch (...) {
+                failure = std::current_exception();
+            }
+        }
+        for (auto &p : pending) {
+            try {
+                p.get();
+            } catch (...) {
+                if (failure == nullptr) {
+                    failure = std::current_exception();
+                }
+            }
+        }
+        if (failure != nullptr) {
+            std::rethrow_exception(failure);
+        }
+    }
+
+    // Element i holds the positions in ids of the ids owned by shard i
+    std::vector<std::vector<std::size_t>> group_by_shard(std::vector<NodeId> const &ids) const {
+        std::vector<std::vector<std::size_t>> groups(shards.size());
+        for (std::size_t i = 0; i < ids.size(); ++i) {
+            groups[shard_of(ids[i])].push_back(i);
+        }
+        return groups;
+    }
+
+    // Entries of the cone may already be erased
+    static void clear_scratch(Shard &shard) noexcept {
+        for (auto const *ids : {&shard.cone, &shard.touched}) {
+            for (NodeId const &id : *ids) {
+                auto iter = shard.nodes.find(id);
+                if (iter != shard.nodes.end()) {
+                    iter->second.in_cone = false;
+                    iter->second.dead_parents = 0;
+                }
+            }
+        }
+        shard.cone.clear();
+        shard.touched.clear();
+    }
+
+public:
+    // shard_count 0 picks one shard per hardware thread
+    explicit ShardedCitationGraph(NodeId const &stem_id, unsigned shard_count = 0) : source_id(stem_id) {
+        shard_count = shard_count != 0 ? shard_count : std::max(1u, std::thread::hardware_concurrency());
+        shards.reserve(shard_count);
+        for (unsigned i = 0; i < shard_count; ++i) {
+            shards.push_back(std::make_unique<Shard>());
+        }
+        shards[shard_of(stem_id)]->nodes.emplace(std::piecewise_construct, std::forward_as_tuple(stem_id),
+                                                 std::forward_as_tuple(stem_id));
+        try {
+            for (auto &shard : shards) {
+                Shard *s = shard.get();
+                shard->worker = std::thread([s] { serve(*s); });
+            }
+        } catch (...) {
+            stop();
+            throw;
+        }
+    }
+
+    ShardedCitationGraph(ShardedCitationGraph const &) = delete;
+
+    ShardedCitationGraph &operator=(ShardedCitationGraph const &) = delete;
+
+    ~ShardedCitationGraph() {
+        stop();
+    }
+
+    std::size_t shard_count() const noexcept {
+        return shards.size();
+    }
+
+    NodeId get_root_id() const {
+        return source_id;
+    }
+
+    std::vector<NodeId> get_children(NodeId const &id) const {
+        return read_shard(id, [&id](Shard &s) {
+            IdSet const &children = s.at(id).children;
+            return std::vector<NodeId>(children.begin(), children.end());
+        });
+    }
+
+    std::vector<NodeId> get_parents(NodeId const &id) const {
+        return read_shard(id, [&id](Shard &s) {
+            IdSet const &parents = s.at(id).parents;
+            return std::vector<NodeId>(parents.begin(), parents.end());
+        });
+    }
+
+    bool exists(NodeId const &id) const {
+        return read_shard(id, [&id](Shard &s) { return s.nodes.count(id) != 0; });
+    }
+
+    // The reference stays valid until the publication is removed
+    const Publication &operator[](NodeId const &id) const {
+        return *read_shard(id, [&id](Shard &s) -> Publication const * { return &s.at(id).value; });
+    }
+
+    // Batched exists(), every shard is locked once for all of its ids
+    std::vector<bool> exists_many(std::vector<NodeId> const &ids) const {
+        std::vector<std::vector<std::size_t>> groups = group_by_shard(ids);
+        std::vector<bool> found(ids.size(), false);
+        for (std::size_t i = 0; i < shards.size(); ++i) {
+            if (groups[i].empty()) {
+                continue;
+            }
+            std::shared_lock<std::shared_mutex> lock(shards[i]->lock);
+            for (std::size_t position : groups[i]) {
+                found[position] = shards[i]->nodes.count(ids[position]) != 0;
+            }
+        }
+        return found;
+    }
+
+    // Number of publications in the graph
+    std::size_t size() const {
+        std::size_t total = 0;
+        for (auto &shard : shards) {
+            std::shared_lock<std::shared_mutex> lock(shard->lock);
+            total += shard->nodes.size();
+        }
+        return total;
+    }
+
+    void create(NodeId const &id, NodeId const &parent_id) {
+        create(id, std::vector<NodeId>(1, parent_id));
+    }
+
+    void create(NodeId const &id, std::vector<NodeId> const &parent_ids) {
+        std::vector<std::size_t> touched{shard_of(id)};
+        for (NodeId const &parent_id : parent_ids) {
+            touched.push_back(shard_of(parent_id));
+        }
+        ShardLocks locks = lock_shards(std::move(touched));
+        if (contains(id)) {
+            throw PublicationAlreadyCreated();
+        }
+        if (parent_ids.empty()) {
+            throw PublicationNotFound();
+        }
+        for (NodeId const &parent_id : parent_ids) {
+            if (parent_id == id || !contains(parent_id)) {
+                throw PublicationNotFound();
+            }
+        }
+
+        Shard &own = *shards[shard_of(id)];
+        auto inserted = own.nodes.emplace(std::piecewise_construct, std::forward_as_tuple(id),
+                                          std::forward_as_tuple(id)).first;
+        std::size_t linked = 0;
+        try {
+            inserted->second.parents.insert(parent_ids.begin(), parent_ids.end());
+            for (; linked < parent_ids.size(); ++linked) {
+                shards[shard_of(parent_ids[linked])]->at(parent_ids[linked]).children.insert(id);
+            }
+        } catch (...) {
+            for (std::size_t i = 0; i < linked; ++i) {
+                shards[shard_of(parent_ids[i])]->at(parent_ids[i]).children.erase(id);
+            }
+            own.nodes.erase(inserted);
+            throw;
+        }
+    }
+
+    void add_citation(NodeId const &child_id, NodeId const &parent_id) {
+        ShardLocks locks = lock_shards({shard_of(child_id), shard_of(parent_id)});
+        auto child = shards[shard_of(child_id)]->nodes.find(child_id);
+        if (child == shards[shard_of(child_id)]->nodes.end() || !contains(parent_id) || child_id == parent_id) {
+            throw PublicationNotFound();
+        }
+        if (!child->second.parents.insert(parent_id).second) {
+            return;
+        }
+        try {
+            shards[shard_of(parent_id)]->at(parent_id).children.insert(child_id);
+        } catch (...) {
+            child->second.parents.erase(parent_id);
+            throw;
+        }
+    }
+
+    /**
+     * Removes id and every publication that cites only removed ones. The cone is collected in
+     * rounds: each shard marks its part of the frontier and tells the shards of their children,
+     * a child whose parents are all marked joins the next round. Nothing is changed until the
+     * whole cone is known.
+     */
+    void remove(NodeId const &id) {
+        std::vector<std::size_t> all(shards.size());
+        std::iota(all.begin(), all.end(), 0);
+        ShardLocks locks = lock_shards(std::move(all));
+        if (!contains(id)) {
+            throw PublicationNotFound();
+        }
+        if (id == source_id) {
+            throw TriedToRemoveRoot();
+        }
+
+        std::size_t n = shards.size();
+        try {
+            std::vector<std::vector<NodeId>> frontier(n);
+            frontier[shard_of(id)].push_back(id);
+            for (bool more = true; more;) {
+                // outbox[from][to] holds the children that shard from reports to shard to
+                std::vector<std::vector<std::vector<NodeId>>> outbox(n, std::vector<std::vector<NodeId>>(n));
+                on_all_shards([&](Shard &s, std::size_t i) {
+                    for (NodeId const &marked : frontier[i]) {
+                        Entry &e = s.nodes.find(marked)->second;
+                        s.cone.push_back(marked);
+                        e.in_cone = true;
+                        for (NodeId const &child : e.children) {
+                            outbox[i][shard_of(child)].push_back(child);
+                        }
+                    }
+                });
+                on_all_shards([&](Shard &s, std::size_t i) {
+                    frontier[i].clear();
+                    for (std::size_t from = 0; from < n; ++from) {
+                        for (NodeId const &child : outbox[from][i]) {
+                            Entry &e = s.nodes.find(child)->second;
+                            if (e.dead_parents++ == 0) {
+                                s.touched.push_back(child);
+                            }
+                            if (e.dead_parents == e.parents.size()) {
+                                frontier[i].push_back(child);
+                            }
+                        }
+                    }
+                });
+                more = std::any_of(frontier.begin(), frontier.end(),
+                                   [](std::vector<NodeId> const &f) { return !f.empty(); });
+            }
+
+            // Edges between the cone and the survivors, as (survivor, removed) per survivor shard
+            std::vector<std::vector<std::vector<std::pair<NodeId, NodeId>>>>
+                    unlink_child(n, std::vector<std::vector<std::pair<NodeId, NodeId>>>(n)),
+                    unlink_parent(n, std::vector<std::vector<std::pair<NodeId, NodeId>>>(n));
+            on_all_shards([&](Shard &s, std::size_t i) {
+                for (NodeId const &removed : s.cone) {
+                    Entry &e = s.nodes.find(removed)->second;
+                    for (NodeId const &parent : e.parents) {
+                        unlink_child[i][shard_of(parent)].emplace_back(parent, removed);
+                    }
+                    for (NodeId const &child : e.children) {
+                        unlink_parent[i][shard_of(child)].emplace_back(child, removed);
+                    }
+                }
+            });
+
+            // Only erasures from here on
+            on_all_shards([&](Shard &s, std::size_t i) {
+                for (std::size_t from = 0; from < n; ++from) {
+                    for (auto const &edge : unlink_child[from][i]) {
+                        Entry &e = s.nodes.find(edge.first)->second;
+                        if (!e.in_cone) {
+                            e.children.erase(edge.second);
+                        }
+                    }
+                    for (auto const &edge : unlink_parent[from][i]) {
+                        Entry &e = s.nodes.find(edge.first)->second;
+                        if (!e.in_cone) {
+                            e.parents.erase(edge.second);
+                        }
+                    }
+                }
+                for (NodeId const &removed : s.cone) {
+                    s.nodes.erase(removed);
+                }
+                clear_scratch(s);
+            });
+        } catch (...) {
+            on_all_shards([](Shard &s, std::size_t) { clear_scratch(s); });
+            throw;
+        }
+    }
+};
+
+#endif //SHARDED_CITATION_GRAPH_H
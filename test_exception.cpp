@@ -1,7 +1,8 @@
 #include <iostream>
 #include <sstream>
 #include "dag.h"
-#include "publication.h"
+#include "Publication.h"
+#include <algorithm>
 
 using namespace std;
 
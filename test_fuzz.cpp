@@ -0,0 +1,423 @@
+#include <iostream>
+#include <sstream>
+#include <random>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <algorithm>
+#include <string>
+#include "dag.h"
+#include "Publication.h"
+
+using namespace std;
+
+/**
+ * Differential fuzzer: random operation traces are applied to CitationGraph and to the
+ * Dag oracle, the two are compared after every step. Seeds are spread over all cores,
+ * a failing trace is shrunk before it is reported.
+ *
+ * Usage: test_fuzz [seeds] [operations per seed] [threads] [first seed]
+ */
+
+using IDag = Dag<int>;
+using ICitationGraph = CitationGraph<Publication<PublicationId>>;
+
+const int ID_RANGE = 48;
+const int ROOT = 0;
+
+enum OpType {
+    CREATE, ADD_CITATION, REMOVE, EXISTS, CHILDREN, PARENTS, RECLAIM, CLONE, ANCESTORS, DESCENDANTS, HAS_CITATION,
+    BATCH_SAVEPOINT, BATCH_ROLLBACK, BATCH_COMMIT
+};
+
+struct Op {
+    OpType type;
+    int id;
+    vector<int> parents;
+    int fault_prob;
+    unsigned fault_seed;
+};
+
+ostream &operator<<(ostream &os, const Op &op) {
+    static const char *names[] = {"create", "add_citation", "remove", "exists", "get_children",
+                                  "get_parents", "reclaim", "clone", "get_ancestors", "get_descendants",
+                                  "has_citation", "savepoint", "rollback_to_savepoint", "commit"};
+    os << names[op.type] << " " << op.id;
+    for (int p : op.parents) {
+        os << " " << p;
+    }
+    if (op.fault_prob > 0) {
+        os << " [faults " << op.fault_prob << "% seed " << op.fault_seed << "]";
+    }
+    return os;
+}
+
+vector<Op> generate_trace(unsigned seed, size_t length) {
+    mt19937 rng(seed);
+    auto pick = [&](int bound) { return static_cast<int>(rng() % bound); };
+    vector<Op> trace;
+    for (size_t i = 0; i < length; ++i) {
+        Op op{static_cast<OpType>(pick(100) < 40 ? CREATE : pick(BATCH_COMMIT + 1)), 1 + pick(ID_RANGE - 1), {}, 0,
+              static_cast<unsigned>(rng())};
+        if (op.type == CREATE || op.type == ADD_CITATION || op.type == HAS_CITATION) {
+            int count = op.type == CREATE ? pick(4) : 1;
+            for (int j = 0; j < count || (op.type == CREATE && op.parents.empty() && pick(8) != 0); ++j) {
+                op.parents.push_back(pick(100) < 3 ? op.id : pick(op.id));
+            }
+        }
+        if (op.type == REMOVE && pick(20) == 0) {
+            op.id = ROOT;
+        }
+        if ((op.type <= REMOVE || op.type == BATCH_ROLLBACK) && pick(4) == 0) {
+            op.fault_prob = 1 + pick(30);
+        }
+        trace.push_back(op);
+    }
+    return trace;
+}
+
+int as_int(const PublicationId &id) {
+    ostringstream os;
+    os << id;
+    return stoi(os.str());
+}
+
+vector<int> sorted_ints(const vector<PublicationId> &ids) {
+    vector<int> v;
+    for (auto const &id : ids) {
+        v.push_back(as_int(id));
+    }
+    sort(v.begin(), v.end());
+    return v;
+}
+
+// Transitive closure in the oracle, start excluded
+vector<int> reachable(map<int, set<int>> &edges, int start) {
+    set<int> seen;
+    vector<int> stack{start};
+    while (!stack.empty()) {
+        int v = stack.back();
+        stack.pop_back();
+        for (int next : edges[v]) {
+            if (seen.insert(next).second) {
+                stack.push_back(next);
+            }
+        }
+    }
+    return vector<int>(seen.begin(), seen.end());
+}
+
+vector<PublicationId> to_ids(const vector<int> &v) {
+    return vector<PublicationId>(v.begin(), v.end());
+}
+
+enum Outcome {
+    OK, ALREADY_CREATED, NOT_FOUND, ROOT_REMOVAL, INJECTED
+};
+
+template<typename F>
+Outcome run_guarded(F &&f) {
+    try {
+        f();
+        return OK;
+    } catch (PublicationAlreadyCreated &) {
+        return ALREADY_CREATED;
+    } catch (PublicationNotFound &) {
+        return NOT_FOUND;
+    } catch (TriedToRemoveRoot &) {
+        return ROOT_REMOVAL;
+    } catch (ComparisonException &) {
+        return INJECTED;
+    }
+}
+
+// Runs a try_ mutation, any exception other than an injected fault escapes
+template<typename F>
+Outcome run_status(F &&f) {
+    static const Outcome outcomes[] = {OK, ALREADY_CREATED, NOT_FOUND, ROOT_REMOVAL};
+    try {
+        return outcomes[f()];
+    } catch (ComparisonException &) {
+        return INJECTED;
+    }
+}
+
+/**
+ * Replays the trace, returns an empty string on success and a description of the first
+ * divergence otherwise.
+ */
+string replay(const vector<Op> &trace, ICitationGraph::RemovalMode mode) {
+    IDag d;
+    d.add_if_absent(ROOT);
+    ICitationGraph graph(ROOT);
+    // Parallel freeing of every cascade, whatever its size
+    graph.set_removal_mode(mode, 2, 1);
+    auto alive = [&](int v) { return d.parents.count(v) > 0; };
+    // The open batch and its savepoints, each with the oracle state it restores
+    unique_ptr<ICitationGraph::Batch> batch;
+    IDag before_batch;
+    vector<pair<size_t, IDag>> savepoints;
+
+    for (size_t step = 0; step < trace.size(); ++step) {
+        const Op &op = trace[step];
+        ostringstream where;
+        where << "step " << step << " (" << op << "): ";
+        string before = IDag::to_string(graph);
+
+        Outcome expected = OK;
+        Outcome actual = OK;
+        PublicationId::seed_exceptions(op.fault_seed);
+        PublicationId::set_exception_prob(op.fault_prob);
+        switch (op.type) {
+            case CREATE: {
+                if (alive(op.id)) {
+                    expected = ALREADY_CREATED;
+                } else if (op.parents.empty() || any_of(op.parents.begin(), op.parents.end(),
+                                                        [&](int p) { return !alive(p) || p == op.id; })) {
+                    expected = NOT_FOUND;
+                }
+                actual = op.fault_seed % 2 == 0 ? run_guarded([&] { graph.create(op.id, to_ids(op.parents)); })
+                                                : run_status([&] { return graph.try_create(op.id, to_ids(op.parents)); });
+                break;
+            }
+            case ADD_CITATION: {
+                int parent = op.parents[0];
+                if (!alive(op.id) || !alive(parent) || parent == op.id) {
+                    expected = NOT_FOUND;
+                }
+                actual = op.fault_seed % 2 == 0 ? run_guarded([&] { graph.add_citation(op.id, parent); })
+                                                : run_status([&] { return graph.try_add_citation(op.id, parent); });
+                break;
+            }
+            case REMOVE: {
+                if (!alive(op.id)) {
+                    expected = NOT_FOUND;
+                } else if (op.id == ROOT) {
+                    expected = ROOT_REMOVAL;
+                }
+                actual = op.fault_seed % 2 == 0 ? run_guarded([&] { graph.remove(op.id); })
+                                                : run_status([&] { return graph.try_remove(op.id); });
+                break;
+            }
+            default:
+                break;
+        }
+        PublicationId::set_exception_prob(0);
+
+        if (actual == INJECTED) {
+            if (IDag::to_string(graph) != before) {
+                return where.str() + "state changed by a failed operation";
+            }
+            continue;
+        }
+        if (actual != expected) {
+            return where.str() + "outcome " + std::to_string(actual) + ", oracle " + std::to_string(expected);
+        }
+        if (expected == OK) {
+            if (op.type == CREATE) {
+                d.add_vertices(op.id, op.parents);
+            } else if (op.type == ADD_CITATION) {
+                d.add_edge(op.parents[0], op.id);
+            } else if (op.type == REMOVE) {
+                d.remove_vertex(op.id);
+            }
+        }
+
+        switch (op.type) {
+            case EXISTS:
+                if (graph.exists(op.id) != alive(op.id)) {
+                    return where.str() + "exists mismatch";
+                }
+                break;
+            case CHILDREN:
+            case PARENTS: {
+                bool children = op.type == CHILDREN;
+                vector<int> got;
+                Outcome outcome = run_guarded([&] {
+                    got = sorted_ints(children ? graph.get_children(op.id) : graph.get_parents(op.id));
+                });
+                if (outcome != (alive(op.id) ? OK : NOT_FOUND)) {
+                    return where.str() + "lookup outcome mismatch";
+                }
+                if (outcome == OK) {
+                    set<int> &want = children ? d.children[op.id] : d.parents[op.id];
+                    if (got != vector<int>(want.begin(), want.end())) {
+                        return where.str() + "adjacency mismatch";
+                    }
+                }
+                break;
+            }
+            case HAS_CITATION:
+                if (graph.has_citation(op.id, op.parents[0]) != (alive(op.id) && d.parents[op.id].count(op.parents[0]) > 0)) {
+                    return where.str() + "has_citation mismatch";
+                }
+                break;
+            case RECLAIM:
+                graph.reclaim(1 + op.fault_seed % 4);
+                break;
+            case ANCESTORS:
+            case DESCENDANTS: {
+                bool up = op.type == ANCESTORS;
+                vector<int> got;
+                Outcome outcome = run_guarded([&] {
+                    got = sorted_ints(up ? graph.get_ancestors(op.id) : graph.get_descendants(op.id));
+                });
+                if (outcome != (alive(op.id) ? OK : NOT_FOUND)) {
+                    return where.str() + "closure outcome mismatch";
+                }
+                if (outcome == OK && got != reachable(up ? d.parents : d.children, op.id)) {
+                    return where.str() + "closure mismatch";
+                }
+                break;
+            }
+            case BATCH_SAVEPOINT:
+                if (batch == nullptr) {
+                    batch.reset(new ICitationGraph::Batch(graph.begin_batch()));
+                    before_batch = d;
+                }
+                savepoints.emplace_back(batch->savepoint(), d);
+                break;
+            case BATCH_ROLLBACK:
+                if (!savepoints.empty()) {
+                    // A failed rollback leaves part of the mutations undone, repeating it finishes
+                    if (run_guarded([&] { batch->rollback_to(savepoints.back().first); }) == INJECTED) {
+                        PublicationId::set_exception_prob(0);
+                        batch->rollback_to(savepoints.back().first);
+                    }
+                    d = savepoints.back().second;
+                    savepoints.pop_back();
+                }
+                break;
+            case BATCH_COMMIT:
+                if (batch != nullptr) {
+                    batch->commit();
+                    batch.reset();
+                    savepoints.clear();
+                }
+                break;
+            case CLONE: {
+                ICitationGraph copy = graph.clone();
+                if (IDag::to_string(copy) != IDag::to_string(graph)) {
+                    return where.str() + "clone differs";
+                }
+                break;
+            }
+            default:
+                break;
+        }
+
+        ostringstream oracle;
+        oracle << d;
+        if (oracle.str() != IDag::to_string(graph)) {
+            return where.str() + "graph differs from oracle\n" + oracle.str() + "vs\n" + IDag::to_string(graph);
+        }
+        // Parents always have smaller ids, so increasing ids are a topological order
+        vector<size_t> longest(ID_RANGE, 0), shortest(ID_RANGE, 0), histogram;
+        size_t publications = 0, citations = 0;
+        for (int v = 0; v < ID_RANGE; ++v) {
+            if (!alive(v)) {
+                continue;
+            }
+            ++publications;
+            citations += d.parents[v].size();
+            for (int p : d.parents[v]) {
+                longest[v] = max(longest[v], longest[p] + 1);
+                shortest[v] = shortest[v] == 0 ? shortest[p] + 1 : min(shortest[v], shortest[p] + 1);
+            }
+            histogram.resize(max(histogram.size(), longest[v] + 1));
+            ++histogram[longest[v]];
+            if (graph.depth(v) != longest[v] || graph.min_depth(v) != shortest[v]) {
+                return where.str() + "depth of " + std::to_string(v) + " differs from oracle";
+            }
+        }
+        if (graph.generation_histogram() != histogram) {
+            return where.str() + "generation histogram differs from oracle";
+        }
+        if (graph.counters().publications != publications || graph.counters().citations != citations) {
+            return where.str() + "counters differ from oracle";
+        }
+        if (!graph.stats(3, 2).consistent) {
+            return where.str() + "stats are inconsistent";
+        }
+        for (int v = 0; v < ID_RANGE; ++v) {
+            if (graph.exists(v) != alive(v)) {
+                return where.str() + "exists(" + std::to_string(v) + ") differs from oracle";
+            }
+            if (alive(v) && (sorted_ints(graph.get_children(v)) != vector<int>(d.children[v].begin(), d.children[v].end()) ||
+                             sorted_ints(graph.get_parents(v)) != vector<int>(d.parents[v].begin(), d.parents[v].end()))) {
+                return where.str() + "adjacency of " + std::to_string(v) + " differs from oracle";
+            }
+        }
+    }
+    if (batch != nullptr) {
+        batch.reset();
+        ostringstream oracle;
+        oracle << before_batch;
+        if (oracle.str() != IDag::to_string(graph)) {
+            return "abandoned batch left changes behind";
+        }
+    }
+    return "";
+}
+
+string replay_all_modes(const vector<Op> &trace) {
+    string failure = replay(trace, ICitationGraph::IMMEDIATE);
+    if (failure.empty()) {
+        failure = replay(trace, ICitationGraph::DEFERRED);
+    }
+    if (failure.empty()) {
+        failure = replay(trace, ICitationGraph::PARALLEL);
+    }
+    return failure;
+}
+
+// Delta debugging: drops chunks of the trace while it keeps failing
+vector<Op> minimize(vector<Op> trace) {
+    for (size_t chunk = trace.size() / 2; chunk > 0; chunk /= 2) {
+        for (size_t begin = 0; begin < trace.size();) {
+            vector<Op> candidate(trace.begin(), trace.begin() + begin);
+            candidate.insert(candidate.end(), trace.begin() + min(trace.size(), begin + chunk), trace.end());
+            if (!replay_all_modes(candidate).empty()) {
+                trace = candidate;
+            } else {
+                begin += chunk;
+            }
+        }
+    }
+    return trace;
+}
+
+int main(int argc, char **argv) {
+    unsigned seeds = argc > 1 ? stoul(argv[1]) : 100;
+    size_t length = argc > 2 ? stoul(argv[2]) : 300;
+    unsigned threads = argc > 3 ? stoul(argv[3]) : max(1u, thread::hardware_concurrency());
+    unsigned first_seed = argc > 4 ? stoul(argv[4]) : 1;
+
+    atomic<unsigned> next_seed{first_seed};
+    atomic<unsigned> failures{0};
+    mutex report;
+    vector<thread> workers;
+    for (unsigned t = 0; t < threads; ++t) {
+        workers.emplace_back([&] {
+            for (unsigned seed = next_seed++; seed < first_seed + seeds; seed = next_seed++) {
+                vector<Op> trace = generate_trace(seed, length);
+                if (replay_all_modes(trace).empty()) {
+                    continue;
+                }
+                vector<Op> minimal = minimize(trace);
+                lock_guard<mutex> lock(report);
+                ++failures;
+                cout << "*** Seed " << seed << " failed, minimized to " << minimal.size() << " operations ***" << endl;
+                for (auto const &op : minimal) {
+                    cout << "  " << op << endl;
+                }
+                cout << replay_all_modes(minimal) << endl;
+            }
+        });
+    }
+    for (auto &w : workers) {
+        w.join();
+    }
+    cout << seeds << " seeds, " << failures << " failed" << endl;
+    return failures == 0 ? 0 : 1;
+}
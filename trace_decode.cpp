@@ -0,0 +1,104 @@
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include "citation_trace.h"
+
+using namespace std;
+
+/**
+ * Offline decoder of CitationTrace::dump() files.
+ *
+ * Usage: trace_decode <dump> [--slowest N | --summary]
+ *
+ * Prints every record ordered by start time, the N slowest operations, or the count and
+ * latency percentiles of each operation type.
+ */
+
+const char *const STATUSES[] = {"ok", "already_created", "not_found", "root_removal"};
+
+string status_name(uint8_t status) {
+    if (status == TraceRecord::THROWN) {
+        return "thrown";
+    }
+    return status < sizeof(STATUSES) / sizeof(STATUSES[0]) ? STATUSES[status] : to_string(status);
+}
+
+string id_text(const char (&id)[TraceRecord::ID_BYTES]) {
+    return string(id, strnlen(id, TraceRecord::ID_BYTES));
+}
+
+void print(const vector<TraceRecord> &records, uint64_t origin) {
+    cout << setw(14) << "start_us" << setw(12) << "duration_us" << setw(7) << "thread" << setw(16) << "op"
+         << setw(16) << "status" << setw(9) << "cascade" << "  id [other]" << endl;
+    cout << fixed << setprecision(3);
+    for (const TraceRecord &r : records) {
+        cout << setw(14) << (r.start_ns - origin) / 1e3 << setw(12) << r.duration_ns / 1e3 << setw(7) << r.thread
+             << setw(16) << TraceRecord::op_name(r.op) << setw(16) << status_name(r.status) << setw(9) << r.cascade
+             << "  " << id_text(r.id);
+        if (r.other_id[0] != 0) {
+            cout << " [" << id_text(r.other_id) << "]";
+        }
+        cout << endl;
+    }
+}
+
+void summary(vector<TraceRecord> records) {
+    sort(records.begin(), records.end(), [](const TraceRecord &a, const TraceRecord &b) {
+        return a.op != b.op ? a.op < b.op : a.duration_ns < b.duration_ns;
+    });
+    cout << setw(16) << "op" << setw(10) << "count" << setw(12) << "p50_us" << setw(12) << "p99_us"
+         << setw(12) << "max_us" << setw(12) << "max_cascade" << endl;
+    cout << fixed << setprecision(3);
+    for (size_t begin = 0, end; begin < records.size(); begin = end) {
+        end = begin;
+        uint32_t cascade = 0;
+        while (end < records.size() && records[end].op == records[begin].op) {
+            cascade = max(cascade, records[end].cascade);
+            ++end;
+        }
+        size_t count = end - begin;
+        auto percentile = [&](size_t p) { return records[begin + (count - 1) * p / 100].duration_ns / 1e3; };
+        cout << setw(16) << TraceRecord::op_name(records[begin].op) << setw(10) << count << setw(12)
+             << percentile(50) << setw(12) << percentile(99) << setw(12) << percentile(100) << setw(12) << cascade
+             << endl;
+    }
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        cerr << "Usage: " << argv[0] << " <dump> [--slowest N | --summary]" << endl;
+        return 2;
+    }
+    ifstream in(argv[1], ios::binary);
+    vector<TraceRecord> records;
+    try {
+        records = CitationTrace::load(in);
+    } catch (TraceFormatError &) {
+        cerr << argv[1] << ": not a citation trace dump" << endl;
+        return 1;
+    }
+    sort(records.begin(), records.end(), [](const TraceRecord &a, const TraceRecord &b) {
+        return a.start_ns < b.start_ns;
+    });
+    uint64_t origin = records.empty() ? 0 : records.front().start_ns;
+
+    string mode = argc > 2 ? argv[2] : "";
+    if (mode == "--summary") {
+        summary(records);
+    } else if (mode == "--slowest") {
+        size_t n = argc > 3 ? strtoul(argv[3], nullptr, 10) : 10;
+        stable_sort(records.begin(), records.end(), [](const TraceRecord &a, const TraceRecord &b) {
+            return a.duration_ns > b.duration_ns;
+        });
+        records.resize(min(n, records.size()));
+        print(records, origin);
+    } else {
+        print(records, origin);
+    }
+    return 0;
+}
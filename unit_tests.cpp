@@ -7,6 +7,12 @@
 #include "citation_graph.h"
 #include "dag.h"
 #include "citation_graph.h"
+#include "citation_wal.h"
+#include "sharded_citation_graph.h"
+#include "citation_query_scheduler.h"
+#include <random>
+#include <numeric>
+#include <fstream>
 #include "Publication.h"
 
 class PublicationExample {
@@ -324,18 +330,1064 @@ BOOST_AUTO_TEST_SUITE(SimpleOperations);
 		gen.create("D", parents_E);
 		gen.remove("B");
 
-		BOOST_ASSERT(gen.get_parents("A").size() == 1);
+		BOOST_ASSERT(gen.get_parents("A").size() == 0);
 		BOOST_ASSERT(gen.get_parents("C").size() == 1);
 		BOOST_ASSERT(gen.get_parents("D").size() == 1);
 
 		BOOST_ASSERT(gen.get_children("A").size() == 1);
 		BOOST_ASSERT(gen.get_children("C").size() == 1);
-		BOOST_ASSERT(gen.get_children("D").size() == 1);
+		BOOST_ASSERT(gen.get_children("D").size() == 0);
+	}
+
+
+
+
+
+	BOOST_AUTO_TEST_CASE(deferred_removal) {
+		CitationGraph<PublicationExample> gen("X");
+		gen.set_removal_mode(CitationGraph<PublicationExample>::DEFERRED);
+		gen.create("A", "X");
+		gen.create("B", "X");
+		gen.create("C", "A");
+		gen.create("D", "C");
+		std::vector<PublicationExample::id_type> parents_E{"C", "B"};
+		gen.create("E", parents_E);
+
+		gen.remove("A");
+		BOOST_CHECK(!gen.exists("A"));
+		BOOST_CHECK(!gen.exists("C"));
+		BOOST_CHECK(!gen.exists("D"));
+		BOOST_CHECK(gen.exists("E"));
+		BOOST_CHECK(gen.get_parents("E").size() == 1);
+		BOOST_CHECK(gen.get_children("X").size() == 1);
+		BOOST_CHECK(gen.pending_reclamation() == 1);
+
+		gen.create("C", "B");
+		BOOST_CHECK(gen.exists("C"));
+		BOOST_CHECK(gen.get_children("C").empty());
+
+		BOOST_CHECK(gen.reclaim(1) == 1);
+		BOOST_CHECK(gen.pending_reclamation() == 1);
+		gen.reclaim();
+		BOOST_CHECK(gen.pending_reclamation() == 0);
+		BOOST_CHECK(gen.exists("C"));
+		BOOST_CHECK(!gen.exists("D"));
+		BOOST_CHECK(gen.get_parents("E").size() == 1);
+		BOOST_CHECK(gen.get_children("B").size() == 2);
+	}
+
+	BOOST_AUTO_TEST_CASE(clone_and_extract) {
+		CitationGraph<PublicationExample> gen("X");
+		gen.create("A", "X");
+		gen.create("B", "X");
+		gen.create("C", "A");
+		std::vector<PublicationExample::id_type> parents_D{"C", "B"};
+		gen.create("D", parents_D);
+
+		CitationGraph<PublicationExample> copy = gen.clone();
+		BOOST_CHECK(copy.to_string() == gen.to_string());
+		copy.remove("A");
+		BOOST_CHECK(gen.exists("A"));
+		BOOST_CHECK(!copy.exists("C"));
+		BOOST_CHECK(copy.get_parents("D").size() == 1);
+
+		CitationGraph<PublicationExample> sub = gen.extract_subgraph("A");
+		BOOST_CHECK(sub.get_root_id() == "A");
+		BOOST_CHECK(sub.exists("C"));
+		BOOST_CHECK(sub.exists("D"));
+		BOOST_CHECK(!sub.exists("B"));
+		BOOST_CHECK(!sub.exists("X"));
+		BOOST_CHECK(sub.get_parents("D").size() == 1);
+		BOOST_CHECK(sub.get_parents("A").empty());
+	}
+
+	BOOST_AUTO_TEST_CASE(top_influential) {
+		CitationGraph<PublicationExample> gen("X");
+		gen.create("A", "X");
+		gen.create("B", "X");
+		gen.create("C", "A");
+		gen.create("D", "C");
+		std::vector<PublicationExample::id_type> parents_E{"C", "B"};
+		gen.create("E", parents_E);
+		gen.create("F", "B");
+
+		auto top = gen.top_influential(2);
+		BOOST_CHECK(top.size() == 2);
+		BOOST_CHECK(top[0].first == "A" && top[0].second == 3);
+		BOOST_CHECK(top[1].first == "B" && top[1].second == 2);
+		BOOST_CHECK(gen.top_influential(10, 3).size() == 6);
+
+		auto estimate = gen.top_influential_estimate(2, 0.05);
+		BOOST_CHECK(estimate[0].first == "A" && estimate[0].second == 3);
+		BOOST_CHECK(estimate[1].first == "B" && estimate[1].second == 2);
+		// 16 registers per sketch of the 7 publications, in which the two citers of B collide
+		auto small = gen.top_influential_estimate(2, 0.26, 1, 7 * 16);
+		BOOST_CHECK(small[0].first == "A" && small[0].second == 3);
+		BOOST_CHECK(small[1].first == "C" && small[1].second == 2);
+		BOOST_CHECK_THROW(gen.top_influential_estimate(2, 0.05, 1, 7 * 16), std::length_error);
 	}
 
+	BOOST_AUTO_TEST_CASE(ancestors_and_descendants) {
+		CitationGraph<PublicationExample> gen("X");
+		gen.create("B", "X");
+		gen.create("A", "X");
+		gen.create("C", "A");
+		std::vector<PublicationExample::id_type> parents_D{"C", "B"};
+		gen.create("D", parents_D);
+
+		using Ids = std::vector<PublicationExample::id_type>;
+		BOOST_CHECK(gen.get_ancestors("D") == Ids({"A", "B", "C", "X"}));
+		BOOST_CHECK(gen.get_descendants("A") == Ids({"C", "D"}));
+		BOOST_CHECK(gen.get_descendants("X") == Ids({"A", "B", "C", "D"}));
 
+		std::uint64_t version = gen.get_version();
+		BOOST_CHECK(gen.get_ancestors("D") == Ids({"A", "B", "C", "X"}));
+		gen.add_citation("D", "A");
+		BOOST_CHECK(gen.get_version() == version + 1);
+		gen.add_citation("D", "A");
+		BOOST_CHECK(gen.get_version() == version + 1);
 
+		gen.remove("C");
+		BOOST_CHECK(gen.get_ancestors("D") == Ids({"A", "B", "X"}));
+		BOOST_CHECK(gen.get_descendants("A") == Ids({"D"}));
+		BOOST_CHECK(gen.query_cache_size() == 3 + 1 + 1 + 1);
+
+		// An unchanging graph keeps no more memoized ids than its limit, dropping the least recently used
+		CitationGraph<Publication<int>> chain(0);
+		for (int i = 1; i < 100; ++i) {
+			chain.create(i, i - 1);
+		}
+		chain.set_query_cache_limit(300);
+		for (int i = 0; i < 100; ++i) {
+			BOOST_CHECK(chain.get_descendants(i).size() == std::size_t(99 - i));
+			BOOST_CHECK(chain.get_ancestors(i).size() == std::size_t(i));
+			BOOST_CHECK(chain.query_cache_size() <= 300);
+		}
+		BOOST_CHECK(chain.get_ancestors(50).size() == 50);
+		BOOST_CHECK(chain.get_descendants(95).size() == 4);
+		chain.set_query_cache_limit(10);
+		BOOST_CHECK(chain.query_cache_size() == 4 + 1);
+		BOOST_CHECK(chain.get_descendants(0).size() == 99);
+		BOOST_CHECK(chain.query_cache_size() == 4 + 1);
+	}
+
+	BOOST_AUTO_TEST_CASE(generations) {
+		CitationGraph<PublicationExample> gen("X");
+		gen.create("A", "X");
+		gen.create("B", "A");
+		gen.create("C", "B");
+		std::vector<PublicationExample::id_type> parents_D{"X", "C"};
+		gen.create("D", parents_D);
+		BOOST_CHECK(gen.depth("X") == 0);
+		BOOST_CHECK(gen.depth("D") == 4);
+		BOOST_CHECK(gen.min_depth("D") == 1);
+		BOOST_CHECK(gen.generation_histogram() == std::vector<std::size_t>({1, 1, 1, 1, 1}));
+
+		gen.create("E", "X");
+		gen.add_citation("A", "E");
+		BOOST_CHECK(gen.depth("C") == 4);
+		BOOST_CHECK(gen.depth("D") == 5);
+		BOOST_CHECK(gen.min_depth("C") == 3);
+
+		gen.remove("B");
+		BOOST_CHECK(gen.depth("D") == 1);
+		BOOST_CHECK(gen.generation_histogram() == std::vector<std::size_t>({1, 2, 1}));
+	}
+
+	BOOST_AUTO_TEST_CASE(has_citation) {
+		CitationGraph<PublicationExample> gen("X");
+		gen.create("A", "X");
+		gen.create("B", "A");
+		BOOST_CHECK(gen.has_citation("B", "A"));
+		BOOST_CHECK(!gen.has_citation("A", "B"));
+		BOOST_CHECK(!gen.has_citation("B", "X"));
+		BOOST_CHECK(!gen.has_citation("B", "Z"));
+		BOOST_CHECK(!gen.has_citation("Z", "A"));
+
+		std::uint64_t version = gen.get_version();
+		gen.add_citation("B", "A");
+		BOOST_CHECK(gen.get_version() == version);
+		BOOST_CHECK(gen.get_parents("B").size() == 1);
+		gen.add_citation("B", "X");
+		BOOST_CHECK(gen.has_citation("B", "X"));
+		gen.remove("A");
+		BOOST_CHECK(!gen.has_citation("B", "A"));
+		BOOST_CHECK(gen.has_citation("B", "X"));
+	}
+
+	BOOST_AUTO_TEST_CASE(batched_lookup) {
+		CitationGraph<PublicationExample> gen("X");
+		gen.create("A", "X");
+		gen.create("B", "A");
+		gen.create("C", "X");
+		gen.remove("A");
+		std::vector<PublicationExample::id_type> ids{"C", "Z", "A", "X", "C", "B"};
+		BOOST_CHECK(gen.exists_many(ids) == std::vector<bool>({true, false, false, true, true, false}));
+
+		std::vector<PublicationExample::id_type> present{"X", "C", "X"};
+		auto publications = gen.lookup_many(present);
+		BOOST_CHECK(publications.size() == 3);
+		BOOST_CHECK(publications[1].get().get_id() == "C");
+		BOOST_CHECK(&publications[0].get() == &gen["X"]);
+		BOOST_CHECK(&publications[2].get() == &gen["X"]);
+		try {
+			gen.lookup_many(ids);
+			BOOST_CHECK(false);
+		} catch (PublicationNotFound &) {
+		}
+	}
+
+	BOOST_AUTO_TEST_CASE(co_citation_and_coupling) {
+		CitationGraph<PublicationExample> gen("X");
+		gen.create("A", "X");
+		gen.create("B", "X");
+		gen.create("C", "X");
+		std::vector<PublicationExample::id_type> ab{"A", "B"};
+		std::vector<PublicationExample::id_type> abc{"A", "B", "C"};
+		gen.create("D", ab);
+		gen.create("E", abc);
+		gen.create("F", "A");
+
+		BOOST_CHECK(gen.co_citation("A", "B") == 2);
+		BOOST_CHECK(gen.co_citation("A", "C") == 1);
+		BOOST_CHECK(gen.co_citation("A", "F") == 0);
+		BOOST_CHECK(gen.coupling("D", "E") == 2);
+		BOOST_CHECK(gen.coupling("E", "F") == 1);
+		BOOST_CHECK(gen.coupling("A", "B") == 1);
+
+		std::vector<PublicationExample::id_type> others{"B", "C", "A", "F"};
+		BOOST_CHECK(gen.co_citation("A", others) == std::vector<std::size_t>({2, 1, 3, 0}));
+		std::vector<PublicationExample::id_type> papers{"E", "F", "D"};
+		BOOST_CHECK(gen.coupling("D", papers) == std::vector<std::size_t>({2, 1, 2}));
+
+		gen.remove("B");
+		BOOST_CHECK(gen.co_citation("A", "C") == 1);
+		BOOST_CHECK(gen.coupling("D", "E") == 1);
+	}
+
+	BOOST_AUTO_TEST_CASE(write_ahead_log) {
+		std::string log_path = "unit_tests_wal.log";
+		std::string snapshot_path = "unit_tests_wal.snapshot";
+		std::remove(log_path.c_str());
+		std::remove(snapshot_path.c_str());
+		std::string expected;
+		{
+			WriteAheadLog<std::string> wal(log_path, 64);
+			CitationGraph<PublicationExample> gen("X");
+			gen.set_log(&wal);
+			gen.create("A", "X");
+			gen.create("B", "X");
+			wal.checkpoint(gen, snapshot_path);
+			std::vector<PublicationExample::id_type> parents{"A", "B"};
+			gen.create("C", parents);
+			gen.create("D", "C");
+			gen.add_citation("D", "B");
+			gen.add_citation("D", "B");
+			gen.remove("A");
+			try {
+				gen.create("E", "A");
+			} catch (PublicationNotFound &) {
+			}
+			expected = gen.to_string();
+		}
+		auto recovered = WriteAheadLog<std::string>::recover<PublicationExample>(snapshot_path, log_path);
+		BOOST_CHECK(recovered != nullptr);
+		BOOST_CHECK(recovered->to_string() == expected);
+
+		CitationGraph<PublicationExample> replayed("X");
+		replayed.create("A", "X");
+		replayed.create("B", "X");
+		BOOST_CHECK(WriteAheadLog<std::string>::replay(log_path, replayed) == 4);
+		BOOST_CHECK(replayed.to_string() == expected);
+
+		// Records logged after a torn tail are not lost behind it at the next recovery
+		std::ofstream(log_path, std::ios::binary | std::ios::app) << std::string("\x01\x20\0\0", 4);
+		{
+			auto torn = WriteAheadLog<std::string>::recover<PublicationExample>(snapshot_path, log_path);
+			BOOST_CHECK(torn->to_string() == expected);
+			WriteAheadLog<std::string> wal(log_path, WriteAheadLog<std::string>::FLUSH_ON_COMMIT);
+			torn->set_log(&wal);
+			torn->create("F", "D");
+			torn->set_log(nullptr);
+		}
+		BOOST_CHECK(WriteAheadLog<std::string>::recover<PublicationExample>(snapshot_path, log_path)->exists("F"));
+
+		// A crash after the snapshot is replaced but before the log is leaves a covered log
+		std::string covered;
+		std::string old_log;
+		{
+			WriteAheadLog<std::string> wal(log_path, 64);
+			recovered->set_log(&wal);
+			recovered->create("E", "D");
+			wal.flush();
+			std::ifstream in(log_path, std::ios::binary);
+			old_log.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+			wal.checkpoint(*recovered, snapshot_path);
+			recovered->set_log(nullptr);
+			covered = recovered->to_string();
+		}
+		std::ofstream(log_path, std::ios::binary) << old_log;
+		BOOST_CHECK(WriteAheadLog<std::string>::recover<PublicationExample>(snapshot_path, log_path)->to_string() == covered);
+		std::remove(log_path.c_str());
+		std::remove(snapshot_path.c_str());
+	}
+
+	BOOST_AUTO_TEST_CASE(change_feed) {
+		using Event = CitationEvent<std::string>;
+		struct Recorder : CitationObserver<std::string> {
+			std::vector<std::vector<Event>> batches;
+
+			void on_events(std::vector<Event> const &events) noexcept override {
+				batches.push_back(events);
+			}
+		} recorder;
+
+		CitationGraph<PublicationExample> gen("X");
+		gen.subscribe(&recorder);
+		gen.create("A", "X");
+		std::vector<PublicationExample::id_type> parents{"A", "X", "A"};
+		gen.create("B", parents);
+		gen.create("C", "B");
+		gen.add_citation("C", "X");
+		gen.add_citation("C", "X");
+		try {
+			gen.create("D", "Z");
+		} catch (PublicationNotFound &) {
+		}
+		BOOST_CHECK(recorder.batches.size() == 4);
+		BOOST_CHECK(recorder.batches[0].size() == 2);
+		BOOST_CHECK(recorder.batches[0][0].type == Event::NODE_CREATED && recorder.batches[0][0].id == "A");
+		BOOST_CHECK(recorder.batches[0][1].type == Event::EDGE_ADDED && recorder.batches[0][1].parent_id == "X");
+		BOOST_CHECK(recorder.batches[1].size() == 3);
+		BOOST_CHECK(recorder.batches[3].size() == 1 && recorder.batches[3][0].id == "C");
+
+		gen.remove("A");
+		BOOST_CHECK(recorder.batches.size() == 5);
+		std::set<std::string> removed;
+		for (auto const &event : recorder.batches[4]) {
+			BOOST_CHECK(event.type == Event::NODE_REMOVED);
+			removed.insert(event.id);
+		}
+		BOOST_CHECK(removed == std::set<std::string>({"A"}));
+
+		gen.remove("B");
+		removed.clear();
+		for (auto const &event : recorder.batches[5]) {
+			removed.insert(event.id);
+		}
+		BOOST_CHECK(removed == std::set<std::string>({"B"}));
+		gen.unsubscribe(&recorder);
+		gen.remove("C");
+		BOOST_CHECK(recorder.batches.size() == 6);
+	}
 
+	BOOST_AUTO_TEST_CASE(move_and_double_buffering) {
+		CitationGraph<PublicationExample> first("X");
+		first.create("A", "X");
+		first.create("B", "A");
+		CitationGraph<PublicationExample> moved(std::move(first));
+		moved.remove("A");
+		BOOST_CHECK(!moved.exists("B"));
+		moved.create("C", "X");
+
+		CitationGraph<PublicationExample> other("Y");
+		other.create("D", "Y");
+		other = std::move(moved);
+		BOOST_CHECK(other.exists("C"));
+		BOOST_CHECK(!other.exists("D"));
+		other.remove("C");
+
+		CitationGraphHandle<PublicationExample> handle(std::move(other));
+		auto old = handle.acquire();
+		BOOST_CHECK(old->get_root_id() == "X");
+
+		std::thread builder([&handle] {
+			CitationGraph<PublicationExample> rebuilt("Z");
+			rebuilt.create("E", "Z");
+			handle.publish(std::move(rebuilt));
+		});
+		builder.join();
+		BOOST_CHECK(handle.acquire()->exists("E"));
+		BOOST_CHECK(old->get_root_id() == "X");
+		BOOST_CHECK(handle.reclaim() == 0);
+		old.reset();
+		BOOST_CHECK(handle.reclaim() == 1);
+	}
+
+	BOOST_AUTO_TEST_CASE(sharded_graph) {
+		for (unsigned shards : {1u, 3u}) {
+			CitationGraph<PublicationExample> expected("0");
+			ShardedCitationGraph<PublicationExample> sharded("0", shards);
+			BOOST_CHECK(sharded.shard_count() == shards);
+			std::mt19937 rng(shards);
+			auto sorted = [](std::vector<std::string> v) {
+				std::sort(v.begin(), v.end());
+				return v;
+			};
+			for (int step = 0; step < 2000; ++step) {
+				std::string id = std::to_string(rng() % 60);
+				// Parents compare smaller than their children, which rules out cycles
+				std::string other = std::to_string(rng() % 60);
+				if (other >= id) {
+					other = "0";
+				}
+				int outcome[2] = {0, 0};
+				auto run = [&](int which, auto &&f) {
+					try {
+						f();
+					} catch (PublicationAlreadyCreated &) {
+						outcome[which] = 1;
+					} catch (PublicationNotFound &) {
+						outcome[which] = 2;
+					} catch (TriedToRemoveRoot &) {
+						outcome[which] = 3;
+					}
+				};
+				switch (rng() % 4) {
+					case 0:
+					case 1:
+						run(0, [&] { expected.create(id, {other, "0"}); });
+						run(1, [&] { sharded.create(id, {other, "0"}); });
+						break;
+					case 2:
+						run(0, [&] { expected.add_citation(id, other); });
+						run(1, [&] { sharded.add_citation(id, other); });
+						break;
+					default:
+						run(0, [&] { expected.remove(id); });
+						run(1, [&] { sharded.remove(id); });
+				}
+				BOOST_CHECK(outcome[0] == outcome[1]);
+				BOOST_CHECK(sharded.exists(id) == expected.exists(id));
+				if (expected.exists(id)) {
+					BOOST_CHECK(sorted(sharded.get_children(id)) == sorted(expected.get_children(id)));
+					BOOST_CHECK(sorted(sharded.get_parents(id)) == sorted(expected.get_parents(id)));
+					BOOST_CHECK(sharded[id].get_id() == id);
+				}
+			}
+			std::vector<std::string> ids;
+			for (int i = 0; i < 60; ++i) {
+				ids.push_back(std::to_string(i));
+			}
+			BOOST_CHECK(sharded.exists_many(ids) == expected.exists_many(ids));
+			BOOST_CHECK(sharded.size() == expected.get_descendants("0").size() + 1);
+		}
+
+		// Concurrent writers, parents always have smaller numbers, which rules out cycles
+		ShardedCitationGraph<PublicationExample> shared("0", 4);
+		auto name = [](unsigned thread, unsigned number) {
+			return std::to_string(thread) + "_" + std::to_string(number);
+		};
+		std::vector<std::thread> writers;
+		for (unsigned t = 0; t < 4; ++t) {
+			writers.emplace_back([&shared, &name, t] {
+				std::mt19937 rng(t);
+				for (unsigned i = 1; i <= 300; ++i) {
+					std::string parent = i == 1 ? "0" : name(rng() % 4, 1 + rng() % (i - 1));
+					try {
+						shared.create(name(t, i), {parent, "0"});
+						if (i % 50 == 0) {
+							shared.remove(name(rng() % 4, i / 2));
+						}
+					} catch (PublicationNotFound &) {
+					}
+					shared.exists(parent);
+				}
+			});
+		}
+		for (auto &writer : writers) {
+			writer.join();
+		}
+		std::size_t alive = 1;
+		for (unsigned t = 0; t < 4; ++t) {
+			for (unsigned i = 1; i <= 300; ++i) {
+				std::string id = name(t, i);
+				if (!shared.exists(id)) {
+					continue;
+				}
+				++alive;
+				for (auto const &parent : shared.get_parents(id)) {
+					auto children = shared.get_children(parent);
+					BOOST_CHECK(std::find(children.begin(), children.end(), id) != children.end());
+				}
+				for (auto const &child : shared.get_children(id)) {
+					auto parents = shared.get_parents(child);
+					BOOST_CHECK(std::find(parents.begin(), parents.end(), id) != parents.end());
+				}
+			}
+		}
+		BOOST_CHECK(shared.size() == alive);
+	}
+
+	BOOST_AUTO_TEST_CASE(publication_store) {
+		CitationGraph<PublicationExample> gen("root");
+		PublicationExample const &root = gen["root"];
+		for (int i = 0; i < 1000; ++i) {
+			gen.create(std::to_string(i), "root");
+		}
+		BOOST_CHECK(&gen["root"] == &root);
+		for (int i = 0; i < 1000; i += 2) {
+			gen.remove(std::to_string(i));
+		}
+		for (int i = 0; i < 1000; i += 2) {
+			gen.create(std::to_string(i), std::to_string(i + 1));
+		}
+		for (int i = 0; i < 1000; ++i) {
+			BOOST_CHECK(gen[std::to_string(i)].get_id() == std::to_string(i));
+		}
+		CitationGraph<PublicationExample> moved(std::move(gen));
+		BOOST_CHECK(&moved["root"] == &root);
+	}
+
+	BOOST_AUTO_TEST_CASE(try_mutations) {
+		using Graph = CitationGraph<PublicationExample>;
+		Graph gen("root");
+		BOOST_CHECK(gen.try_create("A", "root") == Graph::OK);
+		BOOST_CHECK(gen.try_create("A", "root") == Graph::ALREADY_CREATED);
+		BOOST_CHECK(gen.try_create("B", std::vector<std::string>{}) == Graph::NOT_FOUND);
+		BOOST_CHECK(gen.try_create("B", std::vector<std::string>{"A", "missing"}) == Graph::NOT_FOUND);
+		BOOST_CHECK(gen.try_create("B", "B") == Graph::NOT_FOUND);
+		BOOST_CHECK(!gen.exists("B"));
+		BOOST_CHECK(gen.try_create("B", "root") == Graph::OK);
+		BOOST_CHECK(gen.try_add_citation("B", "A") == Graph::OK);
+		BOOST_CHECK(gen.try_add_citation("B", "A") == Graph::OK);
+		BOOST_CHECK(gen.try_add_citation("B", "missing") == Graph::NOT_FOUND);
+		BOOST_CHECK(gen.get_version() == 3);
+		BOOST_CHECK(gen.try_remove("root") == Graph::ROOT_REMOVAL);
+		BOOST_CHECK(gen.try_remove("A") == Graph::OK);
+		BOOST_CHECK(gen.try_remove("A") == Graph::NOT_FOUND);
+		BOOST_CHECK(gen.get_parents("B") == std::vector<std::string>{"root"});
+		BOOST_CHECK_THROW(gen.create("B", "root"), PublicationAlreadyCreated);
+		BOOST_CHECK_THROW(gen.remove("root"), TriedToRemoveRoot);
+	}
+
+	BOOST_AUTO_TEST_CASE(transitive_reduction) {
+		CitationGraph<PublicationExample> gen("root");
+		gen.create("A", "root");
+		gen.create("B", std::vector<std::string>{"A", "root"});
+		gen.create("C", {"B", "A", "root"});
+		gen.create("D", "A");
+		using Edge = std::pair<std::string, std::string>;
+		std::vector<Edge> redundant = gen.redundant_citations();
+		std::sort(redundant.begin(), redundant.end());
+		BOOST_CHECK((redundant == std::vector<Edge>{{"B", "root"}, {"C", "A"}, {"C", "root"}}));
+
+		std::mt19937 rng(7);
+		for (int i = 0; i < 300; ++i) {
+			std::vector<std::string> parents{"root"};
+			for (int j = 0; j < 3 && i > 0; ++j) {
+				parents.push_back("n" + std::to_string(rng() % i));
+			}
+			gen.create("n" + std::to_string(i), parents);
+		}
+		for (unsigned threads : {1u, 3u}) {
+			std::size_t dropped = 0;
+			CitationGraph<PublicationExample> reduced = gen.transitive_reduction(&dropped, threads);
+			BOOST_CHECK(dropped == gen.redundant_citations(threads).size());
+			BOOST_CHECK(reduced.redundant_citations().empty());
+			std::size_t kept = 0;
+			for (std::string const &id : gen.get_descendants("root")) {
+				BOOST_CHECK(reduced.get_descendants(id) == gen.get_descendants(id));
+				BOOST_CHECK(reduced.depth(id) == gen.depth(id));
+				kept += reduced.get_parents(id).size();
+				dropped += gen.get_parents(id).size();
+			}
+			BOOST_CHECK(kept < dropped);
+		}
+	}
+
+	BOOST_AUTO_TEST_CASE(influence_scores) {
+		CitationGraph<PublicationExample> gen("root");
+		std::mt19937 rng(3);
+		std::vector<std::string> ids{"root"};
+		for (int i = 0; i < 200; ++i) {
+			std::vector<std::string> parents;
+			for (int j = 0; j < 1 + i % 4; ++j) {
+				parents.push_back(ids[rng() % ids.size()]);
+			}
+			ids.push_back("n" + std::to_string(i));
+			gen.create(ids.back(), parents);
+		}
+
+		// Plain power iteration over the public interface
+		std::map<std::string, double> expected;
+		for (auto const &id : ids) {
+			expected[id] = 1.0 / ids.size();
+		}
+		for (int iteration = 0; iteration < 200; ++iteration) {
+			double dangling = expected["root"];
+			std::map<std::string, double> next;
+			for (auto const &id : ids) {
+				double sum = 0;
+				for (auto const &citer : gen.get_children(id)) {
+					sum += expected[citer] / gen.get_parents(citer).size();
+				}
+				next[id] = 0.15 / ids.size() + 0.85 * (sum + dangling / ids.size());
+			}
+			expected = next;
+		}
+
+		for (unsigned threads : {1u, 4u}) {
+			auto scores = gen.influence_scores(0.85, 1e-12, 1000, threads);
+			BOOST_CHECK(scores.ids.size() == ids.size());
+			BOOST_CHECK(scores.iterations < 1000);
+			double total = 0;
+			for (auto const &id : ids) {
+				BOOST_CHECK_CLOSE(scores[id], expected[id], 1e-6);
+				total += scores[id];
+			}
+			BOOST_CHECK_CLOSE(total, 1.0, 1e-9);
+		}
+		BOOST_CHECK_THROW(gen.influence_scores()["missing"], PublicationNotFound);
+	}
+
+	BOOST_AUTO_TEST_CASE(frozen_graph) {
+		CitationGraph<PublicationExample> gen("root");
+		std::mt19937 rng(11);
+		std::vector<std::string> ids{"root"};
+		for (int i = 0; i < 300; ++i) {
+			std::vector<std::string> parents;
+			for (int j = 0; j < 1 + i % 3; ++j) {
+				parents.push_back(ids[rng() % ids.size()]);
+			}
+			ids.push_back("n" + std::to_string(i));
+			gen.create(ids.back(), parents);
+		}
+		gen.remove("n7");
+
+		FrozenCitationGraph<PublicationExample> frozen = gen.freeze();
+		BOOST_CHECK(frozen.get_root_id() == "root");
+		BOOST_CHECK(frozen.size() == gen.get_descendants("root").size() + 1);
+		for (auto const &id : ids) {
+			BOOST_CHECK(frozen.exists(id) == gen.exists(id));
+			if (gen.exists(id)) {
+				BOOST_CHECK(frozen.get_children(id) == gen.get_children(id));
+				std::vector<std::string> parents = gen.get_parents(id);
+				std::sort(parents.begin(), parents.end());
+				BOOST_CHECK(frozen.get_parents(id) == parents);
+				BOOST_CHECK(frozen[id].get_id() == id);
+			} else {
+				BOOST_CHECK_THROW(frozen.get_children(id), PublicationNotFound);
+			}
+		}
+	}
+
+	BOOST_AUTO_TEST_CASE(lazy_traversal) {
+		using Graph = CitationGraph<PublicationExample>;
+		Graph gen("root");
+		gen.create("A", "root");
+		gen.create("B", "root");
+		gen.create("C", std::vector<std::string>{"A", "B"});
+		gen.create("D", "C");
+		gen.create("E", "B");
+
+		std::vector<std::string> order(gen.bfs("root").begin(), gen.bfs("root").end());
+		BOOST_CHECK((order == std::vector<std::string>{"root", "A", "B", "C", "E", "D"}));
+		Graph::TraversalScratch scratch;
+		order.assign(gen.dfs("root", SIZE_MAX, &scratch).begin(), gen.dfs("root", SIZE_MAX, &scratch).end());
+		BOOST_CHECK((order == std::vector<std::string>{"root", "A", "C", "D", "B", "E"}));
+
+		std::vector<std::size_t> depths;
+		Graph::Traversal limited = gen.bfs("B", 1, &scratch);
+		for (auto it = limited.begin(); it != limited.end(); ++it) {
+			depths.push_back(it.depth());
+		}
+		BOOST_CHECK((depths == std::vector<std::size_t>{0, 1, 1}));
+
+		Graph::Traversal all = gen.bfs("root", SIZE_MAX, &scratch);
+		auto found = std::find(all.begin(), all.end(), "C");
+		BOOST_CHECK(found != all.end() && found.depth() == 2);
+		BOOST_CHECK(std::distance(found, all.end()) == 3);
+
+		gen.remove("C");
+		order.assign(gen.dfs("A").begin(), gen.dfs("A").end());
+		BOOST_CHECK(order == std::vector<std::string>{"A"});
+		BOOST_CHECK_THROW(gen.bfs("C"), PublicationNotFound);
+
+		std::mt19937 rng(5);
+		std::vector<std::string> ids{"root"};
+		for (int i = 0; i < 500; ++i) {
+			std::vector<std::string> parents{ids[rng() % ids.size()], ids[rng() % ids.size()]};
+			ids.push_back("n" + std::to_string(i));
+			gen.create(ids.back(), parents);
+		}
+		std::vector<std::string> expected = gen.get_descendants("root");
+		expected.push_back("root");
+		std::sort(expected.begin(), expected.end());
+		for (bool breadth_first : {true, false}) {
+			Graph::Traversal traversal = breadth_first ? gen.bfs("root", SIZE_MAX, &scratch) : gen.dfs("root", SIZE_MAX, &scratch);
+			order.assign(traversal.begin(), traversal.end());
+			std::sort(order.begin(), order.end());
+			BOOST_CHECK(order == expected);
+		}
+
+		// Within a max_depth, depth first reaches what breadth first does, even through nodes
+		// it first reached on a longer path
+		for (std::size_t max_depth : {1u, 2u, 3u, 5u}) {
+			std::vector<std::string> reached(gen.bfs("root", max_depth).begin(), gen.bfs("root", max_depth).end());
+			order.assign(gen.dfs("root", max_depth, &scratch).begin(), gen.dfs("root", max_depth, &scratch).end());
+			std::sort(reached.begin(), reached.end());
+			std::sort(order.begin(), order.end());
+			BOOST_CHECK(order == reached);
+		}
+		Graph shortcut("0");
+		shortcut.create("1", "0");
+		shortcut.create("2", std::vector<std::string>{"1", "0"});
+		shortcut.create("3", "2");
+		order.assign(shortcut.dfs("0", 2).begin(), shortcut.dfs("0", 2).end());
+		BOOST_CHECK((order == std::vector<std::string>{"0", "1", "2", "3"}));
+	}
+
+	BOOST_AUTO_TEST_CASE(batch_transactions) {
+		using Event = CitationEvent<std::string>;
+		struct Recorder : CitationObserver<std::string> {
+			std::vector<std::vector<Event>> batches;
+
+			void on_events(std::vector<Event> const &events) noexcept override {
+				batches.push_back(events);
+			}
+		} recorder;
+		std::string log_path = "unit_tests_batch.log";
+		std::remove(log_path.c_str());
+
+		std::string expected;
+		{
+			WriteAheadLog<std::string> wal(log_path, 16);
+			CitationGraph<PublicationExample> gen("X");
+			gen.set_log(&wal);
+			gen.subscribe(&recorder);
+			gen.create("A", "X");
+			gen.create("B", "A");
+			std::string before = gen.to_string();
+			std::vector<std::size_t> histogram = gen.generation_histogram();
+			{
+				auto batch = gen.begin_batch();
+				BOOST_CHECK_THROW(gen.begin_batch(), std::logic_error);
+				gen.create("C", std::vector<std::string>{"A", "B"});
+				gen.remove("A");
+				BOOST_CHECK(!gen.exists("C"));
+				gen.create("A", "X");
+				std::size_t savepoint = batch.savepoint();
+				gen.create("D", "A");
+				gen.add_citation("D", "X");
+				batch.rollback_to(savepoint);
+				BOOST_CHECK(!gen.exists("D") && gen.exists("A") && !gen.exists("B"));
+				BOOST_CHECK(recorder.batches.size() == 2);
+			}
+			BOOST_CHECK(gen.to_string() == before);
+			BOOST_CHECK(gen.generation_histogram() == histogram);
+			BOOST_CHECK(gen.depth("B") == 2);
+
+			auto batch = gen.begin_batch();
+			gen.create("C", std::vector<std::string>{"A", "B", "A"});
+			gen.add_citation("C", "X");
+			gen.remove("B");
+			BOOST_CHECK_THROW(gen.create("C", "X"), PublicationAlreadyCreated);
+			batch.commit();
+			BOOST_CHECK(recorder.batches.size() == 3);
+			std::vector<Event> const &events = recorder.batches.back();
+			BOOST_CHECK(events.size() == 5);
+			BOOST_CHECK(events[0].type == Event::NODE_CREATED && events[0].id == "C");
+			BOOST_CHECK(events[3].type == Event::EDGE_ADDED && events[3].parent_id == "X");
+			BOOST_CHECK(events[4].type == Event::NODE_REMOVED && events[4].id == "B");
+			BOOST_CHECK(gen.get_parents("C").size() == 2);
+			expected = gen.to_string();
+		}
+		CitationGraph<PublicationExample> replayed("X");
+		BOOST_CHECK(WriteAheadLog<std::string>::replay(log_path, replayed) == 5);
+		BOOST_CHECK(replayed.to_string() == expected);
+
+		// A batch torn by a crash is dropped as a whole
+		std::string bytes;
+		{
+			std::ifstream in(log_path, std::ios::binary);
+			bytes.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+		}
+		std::ofstream(log_path, std::ios::binary) << bytes.substr(0, bytes.size() - 1);
+		CitationGraph<PublicationExample> torn("X");
+		BOOST_CHECK(WriteAheadLog<std::string>::replay(log_path, torn) == 2);
+		BOOST_CHECK(torn.exists("B") && !torn.exists("C"));
+		std::remove(log_path.c_str());
+
+		// The undo log of a removal may refer to tombstones, which outlive the batch
+		CitationGraph<PublicationExample> deferred("X");
+		deferred.set_removal_mode(CitationGraph<PublicationExample>::DEFERRED);
+		deferred.create("A", "X");
+		deferred.create("B", std::vector<std::string>{"A", "X"});
+		deferred.remove("A");
+		{
+			auto batch = deferred.begin_batch();
+			deferred.remove("B");
+			BOOST_CHECK(deferred.reclaim() == 0);
+		}
+		BOOST_CHECK(deferred.get_parents("B") == std::vector<std::string>{"X"});
+		BOOST_CHECK(deferred.reclaim() == 1);
+
+		// A batch that cannot be rolled back keeps its mutations instead of terminating
+		CitationGraph<Publication<PublicationId>> faulty(0);
+		faulty.create(1, 0);
+		faulty.create(2, 0);
+		try {
+			auto batch = faulty.begin_batch();
+			faulty.create(3, 1);
+			faulty.remove(1);
+			PublicationId::set_exception_prob(100);
+			throw std::runtime_error("abandoned");
+		} catch (std::runtime_error &) {
+		}
+		PublicationId::set_exception_prob(0);
+		BOOST_CHECK(!faulty.exists(1) && !faulty.exists(3) && faulty.exists(2));
+		BOOST_CHECK(faulty.counters().publications == 2 && faulty.counters().citations == 1);
+		faulty.begin_batch().commit();
+
+		// Observers subscribed within a batch hear every parent of the creates made before
+		CitationGraph<PublicationExample> late("X");
+		late.create("A", "X");
+		{
+			Recorder listener;
+			auto batch = late.begin_batch();
+			late.create("B", "A");
+			late.subscribe(&listener);
+			late.add_citation("B", "X");
+			batch.commit();
+			late.unsubscribe(&listener);
+			BOOST_CHECK(listener.batches.size() == 1 && listener.batches[0].size() == 3);
+			BOOST_CHECK(listener.batches[0][1].type == Event::EDGE_ADDED && listener.batches[0][1].parent_id == "A");
+			BOOST_CHECK(listener.batches[0][2].type == Event::EDGE_ADDED && listener.batches[0][2].parent_id == "X");
+		}
+
+		// A committed batch frees deep cones without recursing, and can no longer be used
+		using Chain = CitationGraph<Publication<int>>;
+		for (auto mode : {Chain::IMMEDIATE, Chain::PARALLEL, Chain::DEFERRED}) {
+			Chain chain(0);
+			chain.set_removal_mode(mode);
+			for (int i = 1; i < 300000; ++i) {
+				chain.create(i, i - 1);
+			}
+			auto batch = chain.begin_batch();
+			chain.remove(2);
+			chain.create(2, 1);
+			chain.remove(1);
+			batch.commit();
+			BOOST_CHECK_THROW(batch.savepoint(), std::logic_error);
+			BOOST_CHECK_THROW(batch.rollback_to(0), std::logic_error);
+			BOOST_CHECK_THROW(batch.commit(), std::logic_error);
+			BOOST_CHECK(chain.counters().publications == 1);
+			BOOST_CHECK(chain.reclaim() == (mode == Chain::DEFERRED ? 300000u : 0u));
+		}
+	}
+
+	BOOST_AUTO_TEST_CASE(binary_trace) {
+		CitationTrace::clear();
+		CitationTrace::enable(64);
+		CitationGraph<PublicationExample> gen("X");
+		gen.create("A", "X");
+		gen.create("B", std::vector<std::string>{"A", "X"});
+		gen.create("C", "B");
+		BOOST_CHECK(gen.try_create("C", "X") == CitationGraph<PublicationExample>::ALREADY_CREATED);
+		BOOST_CHECK_THROW(gen.add_citation("C", "Z"), PublicationNotFound);
+		gen.remove("B");
+		std::thread([] {
+			CitationGraph<Publication<int>> other(0);
+			for (int i = 1; i <= 100; ++i) {
+				other.create(i, i - 1);
+			}
+		}).join();
+		CitationTrace::disable();
+		gen.create("D", "X");
+
+		std::stringstream dump;
+		BOOST_CHECK(CitationTrace::dump(dump) == 70);
+		std::vector<TraceRecord> records = CitationTrace::load(dump);
+		CitationTrace::clear();
+		BOOST_CHECK(records.size() == 70);
+		auto id = [](char const (&text)[TraceRecord::ID_BYTES]) {
+			return std::string(text, strnlen(text, TraceRecord::ID_BYTES));
+		};
+		TraceRecord const &b = records[1];
+		BOOST_CHECK(b.op == TraceRecord::CREATE && id(b.id) == "B" && id(b.other_id) == "A" && b.cascade == 2);
+		BOOST_CHECK(records[3].status == CitationGraph<PublicationExample>::ALREADY_CREATED);
+		BOOST_CHECK(records[4].op == TraceRecord::ADD_CITATION && records[4].status == CitationGraph<PublicationExample>::NOT_FOUND);
+		TraceRecord const &removal = records[5];
+		BOOST_CHECK(removal.op == TraceRecord::REMOVE && id(removal.id) == "B" && removal.cascade == 2);
+		BOOST_CHECK(removal.start_ns >= records[4].start_ns + records[4].duration_ns);
+		// The second thread only kept its last 64 creates
+		BOOST_CHECK(records[6].thread != removal.thread && id(records[6].id) == "37" && id(records[69].other_id) == "99");
+
+		std::stringstream truncated(dump.str().substr(0, 40));
+		BOOST_CHECK_THROW(CitationTrace::load(truncated), TraceFormatError);
+
+		// Rings of exited threads are reused, at once if copied and past MAX_RINGS otherwise
+		CitationTrace::enable(4);
+		auto traced_thread = [] {
+			std::thread([] {
+				CitationGraph<Publication<int>> other(0);
+				other.create(1, 0);
+			}).join();
+		};
+		for (int i = 0; i < 3; ++i) {
+			traced_thread();
+			records = CitationTrace::snapshot();
+			BOOST_CHECK(records.size() == 1 && records[0].thread == 0);
+		}
+		for (std::size_t i = 0; i < CitationTrace::MAX_RINGS + 10; ++i) {
+			traced_thread();
+		}
+		records = CitationTrace::snapshot();
+		BOOST_CHECK(records.size() == CitationTrace::MAX_RINGS);
+		CitationTrace::disable();
+		CitationTrace::clear();
+	}
+
+	BOOST_AUTO_TEST_CASE(parallel_removal) {
+		using Graph = CitationGraph<Publication<int>>;
+		auto build = [](Graph &gen) {
+			std::mt19937 rng(7);
+			gen.create(1, 0);
+			for (int i = 2; i < 20000; ++i) {
+				std::vector<int> parents{1 + static_cast<int>(rng() % (i - 1))};
+				// Survivors, keeping a parent outside of the removed cascade
+				if (rng() % 8 == 0) {
+					parents.push_back(0);
+				}
+				gen.create(i, parents);
+			}
+		};
+		Graph deferred(0), parallel(0);
+		deferred.set_removal_mode(Graph::DEFERRED);
+		parallel.set_removal_mode(Graph::PARALLEL, 4, 1000);
+		build(deferred);
+		build(parallel);
+		deferred.remove(1);
+		deferred.reclaim();
+		parallel.remove(1);
+		BOOST_CHECK(parallel.to_string() == deferred.to_string());
+		BOOST_CHECK(parallel.generation_histogram() == deferred.generation_histogram());
+		parallel.create(1, 0);
+		parallel.create(2, 1);
+		BOOST_CHECK(parallel.get_parents(2) == std::vector<int>{1});
+
+		// Neither removal nor destruction may recurse along the chain
+		Graph chain(0);
+		chain.set_removal_mode(Graph::PARALLEL, 2);
+		for (int i = 1; i <= 200000; ++i) {
+			chain.create(i, i - 1);
+		}
+		chain.remove(100001);
+		BOOST_CHECK(chain.exists(100000) && !chain.exists(100001) && !chain.exists(200000));
+	}
+
+	BOOST_AUTO_TEST_CASE(graph_statistics) {
+		using Graph = CitationGraph<Publication<int>>;
+		Graph gen(0);
+		gen.create(1, 0);
+		gen.create(2, 0);
+		gen.create(3, std::vector<int>{1, 2});
+		gen.create(4, 1);
+		gen.add_citation(4, 0);
+		Graph::GraphStats s = gen.stats(2);
+		BOOST_CHECK(s.publications == 5 && s.citations == 6 && s.consistent);
+		BOOST_CHECK(gen.counters().publications == 5 && gen.counters().citations == 6);
+		BOOST_CHECK((s.in_degrees == std::vector<std::size_t>{1, 2, 2}));
+		BOOST_CHECK((s.out_degrees == std::vector<std::size_t>{2, 1, 1, 1}));
+		BOOST_CHECK((s.hubs == std::vector<std::pair<int, std::size_t>>{{0, 3}, {1, 2}}));
+		BOOST_CHECK((s.depths == std::vector<std::size_t>{1, 2, 2}));
+		BOOST_CHECK((s.min_depths == std::vector<std::size_t>{1, 3, 1}));
+		BOOST_CHECK(s.orphans.empty());
+
+		{
+			auto batch = gen.begin_batch();
+			gen.remove(1);
+			gen.create(5, 3);
+			BOOST_CHECK(gen.counters().publications == 5 && gen.counters().citations == 4);
+		}
+		BOOST_CHECK(gen.counters().publications == 5 && gen.counters().citations == 6);
+		gen.remove(2);
+		BOOST_CHECK(gen.counters().publications == 4 && gen.counters().citations == 4);
+		BOOST_CHECK(gen.stats().consistent);
+
+		// Several workers agree with one
+		Graph big(0);
+		big.set_removal_mode(Graph::DEFERRED);
+		std::mt19937 rng(11);
+		for (int i = 1; i < 60000; ++i) {
+			big.create(i, static_cast<int>(rng() % i));
+			if (rng() % 4 == 0) {
+				big.add_citation(i, static_cast<int>(rng() % i));
+			}
+		}
+		big.remove(7);
+		Graph::GraphStats one = big.stats(5, 1), many = big.stats(5, 4);
+		BOOST_CHECK(one.consistent && many.consistent);
+		BOOST_CHECK(one.in_degrees == many.in_degrees && one.out_degrees == many.out_degrees);
+		BOOST_CHECK(one.hubs == many.hubs && one.min_depths == many.min_depths);
+		BOOST_CHECK(one.publications == big.counters().publications);
+		BOOST_CHECK(big.clone().stats().citations == one.citations);
+		BOOST_CHECK(big.transitive_reduction().counters().citations <= one.citations);
+	}
+
+	BOOST_AUTO_TEST_CASE(query_scheduler) {
+		using Graph = CitationGraph<Publication<int>>;
+		Graph gen(0);
+		gen.create(1, 0);
+		gen.create(2, 0);
+		gen.create(3, std::vector<int>{1, 2});
+		CitationGraphHandle<Publication<int>> handle(std::move(gen));
+		CitationQueryScheduler<Publication<int>> scheduler(handle, 2);
+		auto sorted = [](std::vector<int> v) {
+			std::sort(v.begin(), v.end());
+			return v;
+		};
+
+		std::vector<std::future<std::vector<int>>> children, parents;
+		std::vector<std::future<bool>> found;
+		for (int id = 0; id < 6; ++id) {
+			children.push_back(scheduler.get_children(id));
+			parents.push_back(scheduler.get_parents(id));
+			found.push_back(scheduler.exists(id));
+		}
+		auto ancestors = scheduler.get_ancestors(3);
+		auto missing = scheduler.get_ancestors(9);
+		auto snapshot = handle.acquire();
+		for (int id = 0; id < 6; ++id) {
+			BOOST_CHECK(found[id].get() == snapshot->exists(id));
+			if (snapshot->exists(id)) {
+				BOOST_CHECK(sorted(children[id].get()) == sorted(snapshot->get_children(id)));
+				BOOST_CHECK(sorted(parents[id].get()) == sorted(snapshot->get_parents(id)));
+			} else {
+				BOOST_CHECK_THROW(children[id].get(), PublicationNotFound);
+				BOOST_CHECK_THROW(parents[id].get(), PublicationNotFound);
+			}
+		}
+		BOOST_CHECK((ancestors.get() == std::vector<int>{0, 1, 2}));
+		BOOST_CHECK_THROW(missing.get(), PublicationNotFound);
+
+		// Batches are answered against the snapshot current when they are taken
+		Graph next(0);
+		next.create(7, 0);
+		handle.publish(std::move(next));
+		BOOST_CHECK(scheduler.exists(7).get() && !scheduler.exists(3).get());
+
+		// Lookups through the probe index agree with those through the map
+		Graph big(0);
+		std::mt19937 rng(5);
+		for (int i = 1; i < 5000; ++i) {
+			big.create(i, static_cast<int>(rng() % i));
+		}
+		big.remove(3);
+		std::vector<int> few{4999, 3, 7, 6000, 0}, all(6000);
+		std::iota(all.begin(), all.end(), 0);
+		auto before = big.children_many(few);
+		BOOST_CHECK(before[0] && !before[1] && !before[3]);
+		auto indexed = big.parents_many(all);
+		BOOST_CHECK(big.children_many(few) == before);
+		for (int id : all) {
+			BOOST_CHECK(indexed[id].has_value() == big.exists(id));
+			BOOST_CHECK(!indexed[id] || sorted(*indexed[id]) == sorted(big.get_parents(id)));
+		}
+		big.create(3, 0);
+		BOOST_CHECK(big.exists_many(few)[1]);
+	}
 
 BOOST_AUTO_TEST_SUITE_END()
 